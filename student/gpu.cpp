@@ -13,6 +13,410 @@
 #include <X11/Xmd.h>
 #include "vector"
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RASTER_X86
+#include <immintrin.h>
+#endif
+
+
+/**
+ * @brief Constructor of thread pool
+ *
+ * @param threads number of threads including the calling thread (at least 1)
+ */
+ThreadPool::ThreadPool(uint32_t threads) {
+    if (threads == 0) threads = 1;
+
+    for (uint32_t i = 1; i < threads; i++) {
+        this->workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+/**
+ * @brief Destructor of thread pool
+ */
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stop = true;
+    }
+    this->wake.notify_all();
+
+    for (auto &worker: this->workers) {
+        worker.join();
+    }
+}
+
+/**
+ * @brief This function returns number of threads that run jobs.
+ *
+ * @return number of threads (workers + calling thread)
+ */
+uint32_t ThreadPool::getSize() const {
+    return (uint32_t) this->workers.size() + 1;
+}
+
+/**
+ * @brief This function runs job for every index in range <0, count).
+ * Items are handed out dynamically, the calling thread works as worker 0.
+ * Function returns after all items are finished.
+ *
+ * @param count number of work items
+ * @param job job
+ */
+void ThreadPool::parallelFor(uint32_t count, Job const &job) {
+    if (count == 0) return;
+
+    if (this->workers.empty() or count == 1) {
+        for (uint32_t i = 0; i < count; i++) {
+            job(i, 0);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->job = &job;
+        this->count = count;
+        this->next = 0;
+        this->running = (uint32_t) this->workers.size();
+        this->generation++;
+    }
+    this->wake.notify_all();
+
+    this->runItems(0);
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->done.wait(lock, [this] { return this->running == 0; });
+    this->job = nullptr;
+}
+
+void ThreadPool::workerLoop(uint32_t worker) {
+    uint64_t seen = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->wake.wait(lock, [&] { return this->stop or this->generation != seen; });
+            if (this->stop) return;
+            seen = this->generation;
+        }
+
+        this->runItems(worker);
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->running--;
+        }
+        this->done.notify_one();
+    }
+}
+
+void ThreadPool::runItems(uint32_t worker) {
+    for (uint32_t i = this->next++; i < this->count; i = this->next++) {
+        (*this->job)(i, worker);
+    }
+}
+
+
+// vector kernels work with 32 bit edges, values of the whole block have to fit
+// edge whose sign cannot change inside the block is clamped first, far away blocks then fit as well
+static bool fitsInt32(edgeSetupStructure const &setup, int64_t const edges[3], int64_t clamped[3]) {
+    for (uint8_t i = 0; i < 3; i++) {
+        clamped[i] = std::min(std::max(edges[i], -setup.range[i] - 1), setup.range[i]);
+        if ((clamped[i] < 0 ? -clamped[i] : clamped[i]) + setup.range[i] > INT32_MAX) return false;
+    }
+    return true;
+}
+
+static uint64_t coverScalar(edgeSetupStructure const &setup, int64_t const edges[3]) {
+    uint64_t mask = 0;
+
+    int64_t row[3] = {edges[0], edges[1], edges[2]};
+
+    for (uint32_t r = 0; r < coverageBlockSize; r++) {
+        int64_t e[3] = {row[0], row[1], row[2]};
+
+        for (uint32_t c = 0; c < coverageBlockSize; c++) {
+            // sample is covered when no edge is negative
+            if ((e[0] | e[1] | e[2]) >= 0) mask |= (uint64_t) 1 << (r * coverageBlockSize + c);
+
+            for (uint8_t i = 0; i < 3; i++) e[i] += setup.a[i];
+        }
+
+        for (uint8_t i = 0; i < 3; i++) row[i] += setup.b[i];
+    }
+
+    return mask;
+}
+
+#ifdef RASTER_X86
+
+__attribute__((target("sse2")))
+static uint64_t coverSSE(edgeSetupStructure const &setup, int64_t const edges[3]) {
+    int64_t clamped[3];
+    if (!fitsInt32(setup, edges, clamped)) return coverScalar(setup, edges);
+
+    uint64_t mask = 0;
+
+    __m128i e[2][3];
+    __m128i b[3];
+    for (uint8_t i = 0; i < 3; i++) {
+        int32_t a = (int32_t) setup.a[i];
+        int32_t e0 = (int32_t) clamped[i];
+        e[0][i] = _mm_setr_epi32(e0, e0 + a, e0 + 2 * a, e0 + 3 * a);
+        e[1][i] = _mm_add_epi32(e[0][i], _mm_set1_epi32(4 * a));
+        b[i] = _mm_set1_epi32((int32_t) setup.b[i]);
+    }
+
+    for (uint32_t r = 0; r < coverageBlockSize; r++) {
+        for (uint8_t h = 0; h < 2; h++) {
+            // sign bit of the union is set when any edge is negative
+            __m128i outside = _mm_or_si128(_mm_or_si128(e[h][0], e[h][1]), e[h][2]);
+            uint64_t inside = ~_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xf;
+            mask |= inside << (r * coverageBlockSize + 4 * h);
+
+            for (uint8_t i = 0; i < 3; i++) e[h][i] = _mm_add_epi32(e[h][i], b[i]);
+        }
+    }
+
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t coverAVX2(edgeSetupStructure const &setup, int64_t const edges[3]) {
+    int64_t clamped[3];
+    if (!fitsInt32(setup, edges, clamped)) return coverScalar(setup, edges);
+
+    uint64_t mask = 0;
+
+    __m256i columns = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i e[3];
+    __m256i b[3];
+    for (uint8_t i = 0; i < 3; i++) {
+        e[i] = _mm256_add_epi32(_mm256_set1_epi32((int32_t) clamped[i]),
+                                _mm256_mullo_epi32(columns, _mm256_set1_epi32((int32_t) setup.a[i])));
+        b[i] = _mm256_set1_epi32((int32_t) setup.b[i]);
+    }
+
+    for (uint32_t r = 0; r < coverageBlockSize; r++) {
+        __m256i outside = _mm256_or_si256(_mm256_or_si256(e[0], e[1]), e[2]);
+        uint64_t inside = ~_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xff;
+        mask |= inside << (r * coverageBlockSize);
+
+        for (uint8_t i = 0; i < 3; i++) e[i] = _mm256_add_epi32(e[i], b[i]);
+    }
+
+    return mask;
+}
+
+__attribute__((target("avx512f")))
+static uint64_t coverAVX512(edgeSetupStructure const &setup, int64_t const edges[3]) {
+    int64_t clamped[3];
+    if (!fitsInt32(setup, edges, clamped)) return coverScalar(setup, edges);
+
+    uint64_t mask = 0;
+
+    // two rows per instruction
+    __m512i columns = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7);
+    __m512i rows = _mm512_setr_epi32(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+    __m512i e[3];
+    __m512i b[3];
+    for (uint8_t i = 0; i < 3; i++) {
+        __m512i b1 = _mm512_set1_epi32((int32_t) setup.b[i]);
+        e[i] = _mm512_add_epi32(_mm512_set1_epi32((int32_t) clamped[i]),
+                                _mm512_add_epi32(_mm512_mullo_epi32(columns, _mm512_set1_epi32((int32_t) setup.a[i])),
+                                                 _mm512_mullo_epi32(rows, b1)));
+        b[i] = _mm512_add_epi32(b1, b1);
+    }
+
+    __m512i zero = _mm512_setzero_si512();
+    for (uint32_t r = 0; r < coverageBlockSize; r += 2) {
+        __m512i outside = _mm512_or_si512(_mm512_or_si512(e[0], e[1]), e[2]);
+        mask |= (uint64_t) _mm512_cmpge_epi32_mask(outside, zero) << (r * coverageBlockSize);
+
+        for (uint8_t i = 0; i < 3; i++) e[i] = _mm512_add_epi32(e[i], b[i]);
+    }
+
+    return mask;
+}
+
+#endif
+
+// same result as GPU::convertColor, comparisons are ordered like minps / maxps so NaN gives 0
+static uint32_t packChannel(float value) {
+    value = value > 0.f ? value : 0.f;
+    value = value < 1.f ? value : 1.f;
+    return (uint32_t) (value * 255.f + 0.5f);
+}
+
+/**
+ * @brief This function converts colors to RGBA8 and packs them into pixels.
+ * Every channel is clamped to <0, 1>, scaled to 255 and rounded exactly like GPU::convertColor.
+ *
+ * @param channels arrays of red, green, blue and alpha channels
+ * @param count number of colors
+ * @param packed output pixels, red is stored in the first byte of the pixel
+ */
+void packColors(float const *const channels[4], uint32_t count, uint32_t *packed) {
+    uint32_t i = 0;
+
+#ifdef __SSE2__
+    // sse2 is part of x86-64, the kernel does not need runtime dispatch
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.f);
+    __m128 scale = _mm_set1_ps(255.f);
+    __m128 half = _mm_set1_ps(0.5f);
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_setzero_si128();
+        for (uint8_t c = 0; c < 4; c++) {
+            __m128 value = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(channels[c] + i), zero), one);
+            __m128i bytes = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(value, scale), half));
+            pixels = _mm_or_si128(pixels, _mm_slli_epi32(bytes, 8 * c));
+        }
+        _mm_storeu_si128((__m128i *) (packed + i), pixels);
+    }
+#endif
+
+    // bytes are written one by one, so the channel order does not depend on endianness
+    for (; i < count; i++) {
+        auto *bytes = (uint8_t *) (packed + i);
+        for (uint8_t c = 0; c < 4; c++) {
+            bytes[c] = (uint8_t) packChannel(channels[c][i]);
+        }
+    }
+}
+
+/**
+ * @brief This function tests block of pixels against the triangle edges.
+ * Each edge is evaluated only in the two corners where it reaches its minimum and maximum.
+ *
+ * @param setup edge coefficients
+ * @param edges edges in left bottom pixel of the block
+ * @param size width and height of the block
+ *
+ * @return coverage of the block
+ */
+BlockCoverage classifyBlock(edgeSetupStructure const &setup, int64_t const edges[3], uint32_t size) {
+    int64_t steps = size - 1;
+
+    bool inside = true;
+
+    for (uint8_t i = 0; i < 3; i++) {
+        int64_t step_x = setup.a[i] * steps;
+        int64_t step_y = setup.b[i] * steps;
+
+        int64_t max_edge = edges[i] + std::max(step_x, (int64_t) 0) + std::max(step_y, (int64_t) 0);
+        if (max_edge < 0) return BlockCoverage::OUTSIDE;
+
+        int64_t min_edge = edges[i] + std::min(step_x, (int64_t) 0) + std::min(step_y, (int64_t) 0);
+        inside = inside and min_edge >= 0;
+    }
+
+    return inside ? BlockCoverage::INSIDE : BlockCoverage::PARTIAL;
+}
+
+/**
+ * @brief This function returns widest coverage kernel supported by the cpu.
+ *
+ * @param max_width maximal allowed number of pixels evaluated by one instruction (1, 4, 8 or 16)
+ *
+ * @return number of pixels evaluated by one instruction of the selected kernel
+ */
+uint32_t getCoverageKernelWidth(uint32_t max_width) {
+#ifdef RASTER_X86
+    __builtin_cpu_init();
+    if (max_width >= 16 and __builtin_cpu_supports("avx512f")) return 16;
+    if (max_width >= 8 and __builtin_cpu_supports("avx2")) return 8;
+    if (max_width >= 4 and __builtin_cpu_supports("sse2")) return 4;
+#endif
+    return 1;
+}
+
+/**
+ * @brief This function returns coverage kernel of given width.
+ *
+ * @param width width returned by getCoverageKernelWidth
+ *
+ * @return coverage kernel
+ */
+CoverageKernel getCoverageKernel(uint32_t width) {
+#ifdef RASTER_X86
+    switch (width) {
+        case 16:
+            return coverAVX512;
+        case 8:
+            return coverAVX2;
+        case 4:
+            return coverSSE;
+        default:
+            break;
+    }
+#endif
+    return coverScalar;
+}
+
+static void gatherScalar(uint8_t const *base, uint64_t stride, uint32_t components, uint32_t const *indices,
+                         uint32_t count, float (*out)[vertexBatchLanes]) {
+    for (uint32_t l = 0; l < count; l++) {
+        float value[4];
+        memcpy(value, base + stride * indices[l], components * sizeof(float));
+        for (uint32_t c = 0; c < components; c++) {
+            out[c][l] = value[c];
+        }
+    }
+}
+
+#ifdef RASTER_X86
+
+// one hardware gather per component and 8 lanes, byte offsets of the vertices are shared by all components
+__attribute__((target("avx2")))
+static void gatherAVX2(uint8_t const *base, uint64_t stride, uint32_t components, uint32_t const *indices,
+                       uint32_t count, float (*out)[vertexBatchLanes]) {
+    uint32_t max_index = 0;
+    for (uint32_t l = 0; l < vertexBatchLanes; l++) {
+        max_index = std::max(max_index, indices[l]);
+    }
+    // offsets are 32 bit in the gather instruction
+    if ((uint64_t) max_index * stride + components * sizeof(float) > INT32_MAX) {
+        gatherScalar(base, stride, components, indices, count, out);
+        return;
+    }
+
+    __m256i offsets[vertexBatchLanes / 8];
+    for (uint32_t h = 0; h < vertexBatchLanes / 8; h++) {
+        __m256i lanes = _mm256_loadu_si256((__m256i const *) (indices + 8 * h));
+        offsets[h] = _mm256_mullo_epi32(lanes, _mm256_set1_epi32((int32_t) stride));
+    }
+
+    for (uint32_t c = 0; c < components; c++) {
+        auto const *component = (float const *) (base + c * sizeof(float));
+        for (uint32_t h = 0; h < vertexBatchLanes / 8; h++) {
+            _mm256_storeu_ps(out[c] + 8 * h, _mm256_i32gather_ps(component, offsets[h], 1));
+        }
+    }
+}
+
+#endif
+
+/**
+ * @brief This function returns attribute gather kernel supported by the cpu.
+ *
+ * @return gather kernel
+ */
+GatherKernel getGatherKernel() {
+#ifdef RASTER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return gatherAVX2;
+#endif
+    return gatherScalar;
+}
+
 
 /// \addtogroup gpu_init
 /// @{
@@ -31,8 +435,9 @@ GPU::GPU() {
     this->DP = this->initBS();
 
     this->FB = new frameBufferStructure;
-    this->FB->depthB = nullptr;
-    this->FB->colorB = nullptr;
+
+    this->setCoverageKernelWidth(16);
+    this->gatherKernel = getGatherKernel();
 }
 
 /**
@@ -50,6 +455,8 @@ GPU::~GPU() {
 
     this->deleteFramebuffer();
     delete this->FB;
+
+    delete this->pool;
 }
 
 /// @}
@@ -413,7 +820,9 @@ ProgramID GPU::createProgram() {
     }
 
     newp_prog->fs = nullptr;
+    newp_prog->fsBatch = nullptr;
     newp_prog->vs = nullptr;
+    newp_prog->vsBatch = nullptr;
 
     newp_prog->v2f;
 
@@ -425,6 +834,9 @@ ProgramID GPU::createProgram() {
 
     this->P->Programs[id] = newp_prog;
 
+    // id of deleted active program can be reused
+    if (id == this->P->active) this->selectRasterKernel();
+
     return id;
 }
 
@@ -461,7 +873,59 @@ void GPU::attachShaders(ProgramID prg, VertexShader vs, FragmentShader fs) {
     if (!GPU::isProgram(prg)) return;
 
     this->P->Programs[prg]->vs = vs;
+    this->P->Programs[prg]->vsBatch = nullptr;
+    this->P->Programs[prg]->fs = fs;
+    this->P->Programs[prg]->fsBatch = nullptr;
+}
+
+/**
+ * @brief This function attaches vertex and batched fragment shader to shader program.
+ * Batched fragment shader is called once per batch of up to fragmentBatchLanes fragments.
+ *
+ * @param prg shader program
+ * @param vs vertex shader
+ * @param fs batched fragment shader
+ */
+void GPU::attachShaders(ProgramID prg, VertexShader vs, FragmentShaderBatch fs) {
+    if (!GPU::isProgram(prg)) return;
+
+    this->P->Programs[prg]->vs = vs;
+    this->P->Programs[prg]->vsBatch = nullptr;
+    this->P->Programs[prg]->fs = nullptr;
+    this->P->Programs[prg]->fsBatch = fs;
+}
+
+/**
+ * @brief This function attaches batched vertex shader and fragment shader to shader program.
+ * Batched vertex shader is called once per batch of up to vertexBatchLanes vertices.
+ *
+ * @param prg shader program
+ * @param vs batched vertex shader
+ * @param fs fragment shader
+ */
+void GPU::attachShaders(ProgramID prg, VertexShaderBatch vs, FragmentShader fs) {
+    if (!GPU::isProgram(prg)) return;
+
+    this->P->Programs[prg]->vs = nullptr;
+    this->P->Programs[prg]->vsBatch = vs;
     this->P->Programs[prg]->fs = fs;
+    this->P->Programs[prg]->fsBatch = nullptr;
+}
+
+/**
+ * @brief This function attaches batched vertex and fragment shader to shader program.
+ *
+ * @param prg shader program
+ * @param vs batched vertex shader
+ * @param fs batched fragment shader
+ */
+void GPU::attachShaders(ProgramID prg, VertexShaderBatch vs, FragmentShaderBatch fs) {
+    if (!GPU::isProgram(prg)) return;
+
+    this->P->Programs[prg]->vs = nullptr;
+    this->P->Programs[prg]->vsBatch = vs;
+    this->P->Programs[prg]->fs = nullptr;
+    this->P->Programs[prg]->fsBatch = fs;
 }
 
 /**
@@ -486,6 +950,8 @@ void GPU::setVS2FSType(ProgramID prg, uint32_t attrib, AttributeType type) {
         return;
     }
     this->P->Programs[prg]->v2f[attrib] = type;
+
+    if (prg == this->P->active) this->selectRasterKernel();
 }
 
 /**
@@ -499,6 +965,7 @@ void GPU::useProgram(ProgramID prg) {
     if (!GPU::isProgram(prg)) return;
 
     this->P->active = prg;
+    this->selectRasterKernel();
 }
 
 /**
@@ -627,8 +1094,9 @@ void GPU::programUniformMatrix4f(ProgramID prg, uint32_t uniformId, glm::mat4 co
  *
  * @param width width of framebuffer
  * @param height height of framebuffer
+ * @param format storage format of the depth buffer
  */
-void GPU::createFramebuffer(uint32_t width, uint32_t height) {
+void GPU::createFramebuffer(uint32_t width, uint32_t height, DepthFormat format) {
     /// \todo Tato funkce by měla alokovat framebuffer od daném rozlišení.<br>
     /// Framebuffer se skládá z barevného a hloukového bufferu.<br>
     /// Buffery obsahují width x height pixelů.<br>
@@ -636,22 +1104,42 @@ void GPU::createFramebuffer(uint32_t width, uint32_t height) {
     /// Hloubkový pixel obsahuje 1 x float - to reprezentuje hloubku.<br>
     /// Nultý pixel framebufferu je vlevo dole.<br>
 
-    if (this->FB->depthB != nullptr or this->FB->colorB != nullptr) {
+    if (this->FB->depth != nullptr or this->FB->color != nullptr) {
         this->deleteFramebuffer();
     }
 
-    if (this->FB->depthB != nullptr or this->FB->colorB != nullptr) {
-        return;
-    }
-
     this->FB->width = width;
     this->FB->height = height;
+    this->FB->tiled = this->tiling;
+    this->FB->depth_format = format;
+    DepthPixelS = format == DepthFormat::D16 ? 2 : format == DepthFormat::D24 ? 3 : sizeof(float);
+
+    uint64_t pixels = (uint64_t) width * height;
+
+    if (this->FB->tiled) {
+        // tiled planes are padded to whole micro-tiles
+        this->FB->tiles_x = (width + coverageBlockSize - 1) / coverageBlockSize;
+        uint64_t tiles_y = (height + coverageBlockSize - 1) / coverageBlockSize;
+        uint64_t padded = this->FB->tiles_x * tiles_y * coverageBlockSize * coverageBlockSize;
+
+        this->FB->color = (uint8_t *) this->allocatePlane(ColorPixelS * padded);
+        this->FB->depth = (uint8_t *) this->allocatePlane(DepthPixelS * padded);
+        this->FB->linear_color = (uint8_t *) this->allocatePlane(ColorPixelS * pixels);
+    } else {
+        this->FB->color = (uint8_t *) this->allocatePlane(ColorPixelS * pixels);
+        this->FB->depth = (uint8_t *) this->allocatePlane(DepthPixelS * pixels);
+    }
+
+    // depth that is not stored as linear float is converted on readback
+    if (this->FB->tiled or format != DepthFormat::D32F) {
+        this->FB->linear_depth = (float *) this->allocatePlane(sizeof(float) * pixels);
+    }
 
-    u_long size = (DepthPixelS * width * height) + 3;
-    this->FB->depthB = this->initBS(size);
+    this->initTiles();
+    this->initHiZ(INFINITY);
 
-    size = (ColorPixelS * width * height) + 3;
-    this->FB->colorB = this->initBS(size);
+    this->fastClear.blocks.assign(this->hiZ.blocks.size(), 0);
+    this->fastClear.pending = false;
 }
 
 /**
@@ -660,15 +1148,23 @@ void GPU::createFramebuffer(uint32_t width, uint32_t height) {
 void GPU::deleteFramebuffer() {
     /// \todo tato funkce by měla dealokovat framebuffer.
 
-    if (this->FB->colorB != nullptr) {
-        this->deleteBS(this->FB->colorB);
-        this->FB->colorB = nullptr;
-    }
+    free(this->FB->color);
+    this->FB->color = nullptr;
 
-    if (this->FB->depthB != nullptr) {
-        this->deleteBS(this->FB->depthB);
-        this->FB->depthB = nullptr;
-    }
+    free(this->FB->depth);
+    this->FB->depth = nullptr;
+
+    free(this->FB->linear_color);
+    this->FB->linear_color = nullptr;
+
+    free(this->FB->linear_depth);
+    this->FB->linear_depth = nullptr;
+
+    this->tiles.clear();
+    this->hiZ.blocks.clear();
+    this->hiZ.large.clear();
+    this->fastClear.blocks.clear();
+    this->fastClear.pending = false;
 }
 
 /**
@@ -679,48 +1175,40 @@ void GPU::deleteFramebuffer() {
  */
 void GPU::resizeFramebuffer(uint32_t width, uint32_t height) {
     /// \todo Tato funkce by měla změnit velikost framebuffer.
-    u_long new_size_c = width * height * ColorPixelS + 3;
-    u_long new_size_d = width * height * DepthPixelS + 3;
-
-    buffersStructure *new_cb = this->initBS(new_size_c);
-    buffersStructure *new_db = this->initBS(new_size_d);
-
-    this->deleteBS(this->FB->colorB);
-    this->deleteBS(this->FB->depthB);
-
-    this->FB->colorB = new_cb;
-    this->FB->depthB = new_db;
-
-    this->FB->width = width;
-    this->FB->height = height;
+    this->createFramebuffer(width, height, this->FB->depth_format);
 }
 
 /**
  * @brief This function returns pointer to color buffer.
+ * Pixels are stored in rows from the bottom, ColorPixelS bytes per pixel, the buffer is 64 byte aligned.
+ * Tiled framebuffer is resolved into a linear copy, writes to the copy do not reach the framebuffer.
  *
  * @return pointer to color buffer
  */
 uint8_t *GPU::getFramebufferColor() {
     /// \todo Tato funkce by měla vrátit ukazatel na začátek barevného bufferu.<br>
-    if (this->FB->colorB == nullptr) return nullptr;
-
-    uint8_t *index;
-    index = (uint8_t *) &(this->FB->colorB->bufferArray[0]);
-    return index;
+    this->resolveFastClear();
+    if (this->FB->tiled) {
+        this->resolveLinearColor();
+        return this->FB->linear_color;
+    }
+    return this->FB->color;
 }
 
 /**
  * @brief This function returns pointer to depth buffer.
+ * Depth is returned as float in NDC, other formats and the tiled layout are resolved into a linear copy.
  *
  * @return pointer to dept buffer.
  */
 float *GPU::getFramebufferDepth() {
     /// \todo tato funkce by mla vrátit ukazatel na začátek hloubkového bufferu.<br>
-    if (this->FB->depthB == nullptr) return nullptr;
-
-    float *index;
-    index = (float *) &(this->FB->depthB->bufferArray[0]);
-    return index;
+    this->resolveFastClear();
+    if (this->FB->linear_depth != nullptr) {
+        this->resolveLinearDepth();
+        return this->FB->linear_depth;
+    }
+    return (float *) this->FB->depth;
 }
 
 /**
@@ -730,7 +1218,7 @@ float *GPU::getFramebufferDepth() {
  */
 uint32_t GPU::getFramebufferWidth() {
     /// \todo Tato funkce by měla vrátit šířku framebufferu.
-    if (this->FB->colorB == nullptr or this->FB->depthB == nullptr) return 0;
+    if (this->FB->color == nullptr or this->FB->depth == nullptr) return 0;
     return this->FB->width;
 }
 
@@ -742,65 +1230,217 @@ uint32_t GPU::getFramebufferWidth() {
 uint32_t GPU::getFramebufferHeight() {
     /// \todo Tato funkce by měla vrátit výšku framebufferu.
 
-    if (this->FB->colorB == nullptr or this->FB->depthB == nullptr) return 0;
+    if (this->FB->color == nullptr or this->FB->depth == nullptr) return 0;
     return this->FB->height;
 }
 
-/// @}
+/**
+ * @brief This function returns storage format of the depth buffer.
+ *
+ * @return depth format selected by createFramebuffer
+ */
+DepthFormat GPU::getFramebufferDepthFormat() {
+    return this->FB->depth_format;
+}
 
-/** \addtogroup draw_tasks 05. Implementace vykreslovacích funkcí
- * Bližší informace jsou uvedeny na hlavní stránce dokumentace.
- * @{
+/**
+ * @brief This function selects if framebuffers are backed by huge pages.
+ * It takes effect when the framebuffer is created or resized, it is only a hint on systems without huge pages.
+ *
+ * @param enable true to request huge pages for large framebuffers
  */
+void GPU::setFramebufferHugePages(bool enable) {
+    this->hugePages = enable;
+}
 
 /**
- * @brief This functino clears framebuffer.
+ * @brief This function selects if color and depth are stored in 8x8 micro-tiles instead of rows.
+ * Pixels of one micro-tile share cache lines and pages, which improves locality of rasterization.
+ * It takes effect when the framebuffer is created or resized, readback functions always return linear images.
  *
- * @param r red channel
- * @param g green channel
- * @param b blue channel
- * @param a alpha channel
+ * @param enable true to use the tiled layout
  */
-void GPU::clear(float r, float g, float b, float a) {
-    /// \todo Tato funkce by měla vyčistit framebuffer.<br>
-    /// Barevný buffer vyčistí na barvu podle parametrů r g b a (0 - nulová intenzita, 1 a větší - maximální intenzita).<br>
-    /// (0,0,0) - černá barva, (1,1,1) - bílá barva.<br>
-    /// Hloubkový buffer nastaví na takovou hodnotu, která umožní rasterizaci trojúhelníka, který leží v rámci pohledového tělesa.<br>
-    /// Hloubka by měla být tedy větší než maximální hloubka v NDC (normalized device coordinates).<br>
+void GPU::setFramebufferTiling(bool enable) {
+    this->tiling = enable;
+}
 
-    if (this->FB->depthB == nullptr or this->FB->colorB == nullptr) return;
+// spreads 3 bits of the coordinate to the even bits of the Morton index
+static uint64_t spreadMorton(uint64_t v) {
+    return (v & 1) | (v & 2) << 1 | (v & 4) << 2;
+}
 
-    std::vector<float> colors_float{r, g, b, a};
-    uint8_t color_byte[4];
+uint64_t GPU::pixelOffset(uint64_t x, uint64_t y) {
+    if (!this->FB->tiled) return y * this->FB->width + x;
 
-    for (uint8_t i = 0; i < 4; i++) {
-        color_byte[i] = convertColor(colors_float[i]);
-    }
+    uint64_t tile = (y / coverageBlockSize) * this->FB->tiles_x + x / coverageBlockSize;
+    return tile * coverageBlockSize * coverageBlockSize + (spreadMorton(x & 7) | spreadMorton(y & 7) << 1);
+}
+
+void GPU::resolveLinearColor() {
+    uint64_t width = this->FB->width;
+    uint64_t height = this->FB->height;
+    auto const *color = (uint32_t const *) this->FB->color;
+    auto *linear_color = (uint32_t *) this->FB->linear_color;
 
-    float dep = 1.1f;
+    for (uint64_t y = 0; y < height; y++) {
+        for (uint64_t x = 0; x < width; x++) {
+            linear_color[y * width + x] = color[pixelOffset(x, y)];
+        }
+    }
+}
 
-    uint64_t maxId = this->FB->height * this->FB->width;
-    void *color_pointer = this->FB->colorB->bufferArray;
-    void *depth_pointer = this->FB->depthB->bufferArray;
+void GPU::resolveLinearDepth() {
+    uint64_t width = this->FB->width;
+    uint64_t height = this->FB->height;
 
-    for (uint64_t index = 0; index < maxId; index++) {
-        memcpy(color_pointer + (ColorPixelS * index), &color_byte, ColorPixelS);
-        memcpy(depth_pointer + (DepthPixelS * index), &dep, DepthPixelS);
+    for (uint64_t y = 0; y < height; y++) {
+        for (uint64_t x = 0; x < width; x++) {
+            this->FB->linear_depth[y * width + x] = depthFromKey(loadDepthKey(pixelOffset(x, y)));
+        }
     }
 }
 
+// planes backed by huge pages are aligned and padded to the huge page size
+void *GPU::allocatePlane(size_t size) {
+    size_t alignment = FRAMEBUFFER_ALIGNMENT;
+#ifdef __linux__
+    if (this->hugePages and size >= HUGE_PAGE_SIZE) alignment = HUGE_PAGE_SIZE;
+#endif
 
-void GPU::drawTriangles(uint32_t nofVertices) {
-    /// \todo Tato funkce vykreslí trojúhelníky podle daného nastavení.<br>
-    /// Vrcholy se budou vybírat podle nastavení z aktivního vertex pulleru (pomocí bindVertexPuller).<br>
-    /// Vertex shader a fragment shader se zvolí podle aktivního shader programu (pomocí useProgram).<br>
-    /// Parametr "nofVertices" obsahuje počet vrcholů, který by se měl vykreslit (3 pro jeden trojúhelník).<br>
+    size = std::max((size + alignment - 1) / alignment * alignment, alignment);
+    void *plane = aligned_alloc(alignment, size);
 
-    if (nofVertices < 3) return;
-    if (nofVertices % 3 != 0) return;
-    if (this->VP->active == emptyID) return;
-    if (this->P->active == emptyID) return;
-    if (!this->isVertexPuller(this->VP->active)) return;
+#ifdef __linux__
+    if (plane != nullptr and alignment == HUGE_PAGE_SIZE) madvise(plane, size, MADV_HUGEPAGE);
+#endif
+
+    return plane;
+}
+
+/// @}
+
+/** \addtogroup draw_tasks 05. Implementace vykreslovacích funkcí
+ * Bližší informace jsou uvedeny na hlavní stránce dokumentace.
+ * @{
+ */
+
+/**
+ * @brief This function enables depth test.
+ */
+void GPU::enableDepthTest() {
+    this->depthState.test = true;
+}
+
+/**
+ * @brief This function disables depth test, depth buffer is not written while the test is disabled.
+ */
+void GPU::disableDepthTest() {
+    this->depthState.test = false;
+}
+
+/**
+ * @brief This function sets comparison function of the depth test.
+ *
+ * @param func depth function
+ */
+void GPU::setDepthFunction(DepthFunction func) {
+    this->depthState.func = func;
+}
+
+/**
+ * @brief This function enables or disables writing of passed fragments to depth buffer.
+ *
+ * @param write true if depth of passed fragments is written
+ */
+void GPU::setDepthWriteMask(bool write) {
+    this->depthState.write = write;
+}
+
+/**
+ * @brief This function sets depth that is written to depth buffer by clear.
+ * Reversed depth setups clear to the nearest depth and test with GREATER or GEQUAL.
+ *
+ * @param depth clear depth in normalized device coordinates
+ */
+void GPU::setClearDepth(float depth) {
+    this->depthState.clear = depth;
+}
+
+/**
+ * @brief This function selects faces that are culled before rasterization.
+ *
+ * @param mode culled faces
+ */
+void GPU::setCullFace(CullFace mode) {
+    this->cullFace = mode;
+}
+
+/**
+ * @brief This function sets winding of front facing triangles.
+ *
+ * @param face winding of front facing triangles in window coordinates
+ */
+void GPU::setFrontFace(FrontFace face) {
+    this->frontFace = face;
+}
+
+/**
+ * @brief This functino clears framebuffer.
+ * Only the clear values are recorded, pixels are filled when they are first drawn
+ * or when the buffers are read through getFramebufferColor or getFramebufferDepth.
+ *
+ * @param r red channel
+ * @param g green channel
+ * @param b blue channel
+ * @param a alpha channel
+ */
+void GPU::clear(float r, float g, float b, float a) {
+    /// \todo Tato funkce by měla vyčistit framebuffer.<br>
+    /// Barevný buffer vyčistí na barvu podle parametrů r g b a (0 - nulová intenzita, 1 a větší - maximální intenzita).<br>
+    /// (0,0,0) - černá barva, (1,1,1) - bílá barva.<br>
+    /// Hloubkový buffer nastaví na takovou hodnotu, která umožní rasterizaci trojúhelníka, který leží v rámci pohledového tělesa.<br>
+    /// Hloubka by měla být tedy větší než maximální hloubka v NDC (normalized device coordinates).<br>
+
+    if (this->FB->depth == nullptr or this->FB->color == nullptr) return;
+
+    std::vector<float> colors_float{r, g, b, a};
+    uint8_t color_byte[4];
+
+    for (uint8_t i = 0; i < 4; i++) {
+        color_byte[i] = convertColor(colors_float[i]);
+    }
+
+    float dep = this->depthState.clear;
+
+    // pixels are written later by resolveClearBlock or resolveFastClear
+    memcpy(&this->fastClear.color, color_byte, ColorPixelS);
+    this->fastClear.depth = depthKey(dep);
+    std::fill(this->fastClear.blocks.begin(), this->fastClear.blocks.end(), 1);
+    this->fastClear.pending = true;
+
+    this->initHiZ(this->fastClear.depth);
+}
+
+
+/**
+ * @brief This function draws triangles.
+ *
+ * Triangles are streamed through the pipeline in batches (see \ref GPU::setDrawBatchSize),
+ * so the memory needed by one draw call does not grow with the number of triangles.
+ *
+ * @param nofVertices number of vertices
+ */
+void GPU::drawTriangles(uint32_t nofVertices) {
+    /// \todo Tato funkce vykreslí trojúhelníky podle daného nastavení.<br>
+    /// Vrcholy se budou vybírat podle nastavení z aktivního vertex pulleru (pomocí bindVertexPuller).<br>
+    /// Vertex shader a fragment shader se zvolí podle aktivního shader programu (pomocí useProgram).<br>
+    /// Parametr "nofVertices" obsahuje počet vrcholů, který by se měl vykreslit (3 pro jeden trojúhelník).<br>
+
+    if (nofVertices < 3) return;
+    if (nofVertices % 3 != 0) return;
+    if (this->VP->active == emptyID) return;
+    if (this->P->active == emptyID) return;
+    if (!this->isVertexPuller(this->VP->active)) return;
     if (!this->isProgram(this->P->active)) return;
 
     vertexPullerSettingStructure *current_puller = this->VP->Pullers[this->VP->active];
@@ -808,72 +1448,586 @@ void GPU::drawTriangles(uint32_t nofVertices) {
 
     if (current_program == nullptr or current_puller == nullptr) return;
 
-    std::vector<Assembly> assemblies;
     uint32_t triangle_num = nofVertices / 3;
 
-    AttributeType attribute_types[maxAttributes];
-
-    std::vector<Assembly> clipped_assemblies;
+    uint32_t batch_size = this->triangleBatchSize;
+    if (batch_size == 0 or batch_size > triangle_num) batch_size = triangle_num;
 
     auto frame_width = (float) getFramebufferWidth();
     auto frame_height = (float) getFramebufferHeight();
 
-    std::vector<InFragment> in_fragments;
-    std::vector<InFragment> new_in_fragments;
+    // guard band in NDC, it keeps snapped coordinates of unclipped triangles in range of the fixed point rasterizer
+    float guard_pixels = std::ldexp(1.f, 27 - (int32_t) this->subpixelBits);
+    glm::vec2 guard_band(std::max(1.f, 2 * guard_pixels / frame_width), std::max(1.f, 2 * guard_pixels / frame_height));
 
-    OutFragment out_frag{};
-    for (uint8_t i = 0; i < 4; i++) {
-        out_frag.gl_FragColor[i] = 0;
+    // viewport maps NDC <-1, 1> to <0, size - 1>, so centers of the last column and row lie just past NDC 1
+    glm::vec2 view_extent(frame_width / std::max(frame_width - 1.f, 1.f),
+                          frame_height / std::max(frame_height - 1.f, 1.f));
+
+    // assemblies are filled directly by the vertex processor, invocation i goes to assemblies[i / 3].ov[i % 3]
+    std::vector<Assembly> assemblies(batch_size);
+    std::vector<Assembly> clipped_assemblies;
+    clipped_assemblies.reserve(batch_size * 2);
+    std::vector<triangleSetupStructure> triangles;
+    std::vector<planeStructure> varying_planes;
+
+    varyingLayoutStructure const &layout = this->varyingLayout;
+
+    // one fragment queue per raster worker
+    std::vector<fragmentQueueStructure> queues(this->pool == nullptr ? 1 : this->pool->getSize());
+    for (auto &queue: queues) {
+        queue.program = current_program;
+        queue.layout = &layout;
+        queue.stride = 1 + 4 * (4 + layout.count);
+        queue.capacity = this->fragmentBatchSize;
+        if (queue.capacity != 0) queue.fragments.reserve((queue.capacity + 3) * queue.stride);
+    }
+
+    tileStructure screen;
+    screen.left_down[0] = 0;
+    screen.left_down[1] = 0;
+    screen.right_top[0] = getFramebufferWidth() - 1;
+    screen.right_top[1] = getFramebufferHeight() - 1;
+
+    // heads and buffers may change after bind, so the plan is compiled at every draw
+    fetchPlanStructure plan;
+    compileFetchPlan(current_puller, plan);
+
+    bool caching = plan.indices != nullptr and beginVertexCache(plan, 3 * triangle_num);
+
+    for (uint32_t batch_start = 0; batch_start < triangle_num; batch_start += batch_size) {
+        uint32_t batch_end = std::min(batch_start + batch_size, triangle_num);
+
+        uint32_t batch_triangles = batch_end - batch_start;
+
+        clipped_assemblies.clear();
+
+        // vertex processor
+        if (caching) {
+            processIndexedVertices(current_program, plan, 3 * batch_start, 3 * batch_triangles, assemblies.data());
+        } else {
+            processVertices(current_program, plan, 3 * batch_start, 3 * batch_triangles, assemblies.data());
+        }
+
+        // trivial reject against the view frustum, only triangles crossing the guard band are clipped
+        for (uint32_t i = 0; i < batch_triangles; i++) {
+            uint32_t codes[3];
+            for (uint8_t j = 0; j < 3; j++) {
+                codes[j] = getClipCode(assemblies[i].ov[j].gl_Position, view_extent, guard_band);
+            }
+
+            if ((codes[0] & codes[1] & codes[2] & CLIP_FRUSTUM) != 0) continue;
+
+            if (((codes[0] | codes[1] | codes[2]) & CLIP_GUARD) == 0) {
+                clipped_assemblies.push_back(assemblies[i]);
+                continue;
+            }
+
+            clipAssembly(assemblies[i], layout, guard_band, clipped_assemblies);
+        }
+
+        // perspective division + viewport transformation + culling
+        for (auto &assembly: clipped_assemblies) {
+            perspectiveDivision(assembly);
+            viewPortTransformation(assembly, frame_width, frame_height);
+        }
+        clipped_assemblies.erase(std::remove_if(clipped_assemblies.begin(), clipped_assemblies.end(),
+                                                [this](Assembly &assembly) { return isCulled(assembly); }),
+                                 clipped_assemblies.end());
+
+        // triangle setup
+        triangles.resize(clipped_assemblies.size());
+        varying_planes.resize(clipped_assemblies.size() * layout.count);
+        parallelChunks((uint32_t) clipped_assemblies.size(), [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                triangles[i].varyings = varying_planes.data() + i * layout.count;
+                setupTriangle(clipped_assemblies[i], layout, triangles[i]);
+            }
+        });
+
+        // rasterization, fragments are shaded whenever the queue gets full
+        if (this->pool == nullptr) {
+            for (auto &triangle: triangles) {
+                (this->*rasterKernel)(triangle, layout, screen, queues[0]);
+            }
+            continue;
+        }
+
+        // sort-middle: every tile is owned by one worker, so the framebuffer is written without locks
+        binTriangles(triangles);
+
+        this->pool->parallelFor((uint32_t) this->tiles.size(), [&](uint32_t tile_id, uint32_t worker) {
+            tileStructure &tile = this->tiles[tile_id];
+            if (tile.triangles.empty()) return;
+
+            for (auto triangle: tile.triangles) {
+                (this->*rasterKernel)(triangles[triangle], layout, tile, queues[worker]);
+            }
+            flushFragments(queues[worker]);
+        });
+    }
+
+    // fragment processor + per fragment
+    flushFragments(queues[0]);
+}
+
+/**
+ * @brief This function sets size of the batches that are streamed through the pipeline.
+ *
+ * @param triangles number of triangles processed by the geometry stages at once (0 - whole draw call)
+ * @param fragments number of fragments that are collected before the fragment shader is run (0 - unlimited)
+ */
+void GPU::setDrawBatchSize(uint32_t triangles, uint32_t fragments) {
+    this->triangleBatchSize = triangles;
+    this->fragmentBatchSize = fragments;
+}
+
+/**
+ * @brief This function sets number of threads used for rasterization and fragment processing.
+ * With more than one thread the screen is split into tiles and every tile is processed by one thread.
+ *
+ * @param threads number of threads (0 - number of cpu cores)
+ */
+void GPU::setRasterThreads(uint32_t threads) {
+    if (threads == 0) threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    delete this->pool;
+    this->pool = nullptr;
+
+    if (threads > 1) {
+        this->pool = new ThreadPool(threads);
+    }
+}
+
+/**
+ * @brief This function sets size of screen tiles used by multithreaded rasterization.
+ * Size is rounded up to multiple of 32, so every block of the hierarchical depth buffer belongs to one tile.
+ *
+ * @param size width and height of tile in pixels
+ */
+void GPU::setTileSize(uint32_t size) {
+    if (size == 0) return;
+
+    this->tileSize = (size + LARGE_BLOCK - 1) / LARGE_BLOCK * LARGE_BLOCK;
+    this->initTiles();
+}
+
+/**
+ * @brief This function selects coverage kernel used by the rasterizer.
+ * The widest kernel supported by the cpu that is not wider than width is used.
+ *
+ * @param width maximal number of pixels tested by one instruction (1 - scalar, 4 - SSE, 8 - AVX2, 16 - AVX-512)
+ */
+void GPU::setCoverageKernelWidth(uint32_t width) {
+    this->coverageKernelWidth = getCoverageKernelWidth(width);
+    this->coverageKernel = getCoverageKernel(this->coverageKernelWidth);
+}
+
+/**
+ * @brief This function sets sub-pixel precision of the rasterizer.
+ * Vertices are snapped to a grid of 2^bits positions per pixel before the edges are set up.
+ *
+ * @param bits number of fractional bits of fixed point coordinates (1 - 16)
+ */
+void GPU::setSubpixelBits(uint32_t bits) {
+    this->subpixelBits = std::min(std::max(bits, (uint32_t) 1), MAX_SUBPIXEL_BITS);
+}
+
+/**
+ * @brief This function returns hit rate of the post-transform vertex cache used by indexed draw calls.
+ *
+ * @return ratio of vertices that were taken from the cache instead of running the vertex shader
+ */
+float GPU::getVertexCacheHitRate() {
+    if (this->vertexCache.lookups == 0) return 0.f;
+    return (float) this->vertexCache.hits / (float) this->vertexCache.lookups;
+}
+
+/**
+ * @brief This function resets statistics of the post-transform vertex cache.
+ */
+void GPU::resetVertexCacheStats() {
+    this->vertexCache.hits = 0;
+    this->vertexCache.lookups = 0;
+}
+
+float *GPU::pushQuad(GPU::fragmentQueueStructure &queue, uint32_t covered) {
+    if (queue.capacity != 0 and queue.count >= queue.capacity) {
+        flushFragments(queue);
     }
 
-    // vertex processor
-    Assembly a{};
-    InVertex iv{};
-    OutVertex ov{};
+    size_t offset = queue.fragments.size();
+    queue.fragments.resize(offset + queue.stride);
+    queue.count += covered;
 
-    for (uint32_t tr_num = 0; tr_num < triangle_num; tr_num++) {
-        for (uint32_t i = 0; i < 3; i++) {
-            this->pullVP(current_puller, 3 * tr_num + i, &iv);
-            current_program->vs(ov, iv, *(current_program->uni));
-            a.ov[i] = ov;
+    return queue.fragments.data() + offset;
+}
+
+void GPU::selectRasterKernel() {
+    // raster kernels specialized for common varying signatures: none, VEC2, VEC3, VEC4, 2x VEC3, 2x VEC4 ...
+    static RasterKernel const kernels[MAX_SPECIALIZED_VARYINGS + 1] = {
+            &GPU::rasterize<0>, &GPU::rasterize<1>, &GPU::rasterize<2>, &GPU::rasterize<3>, &GPU::rasterize<4>,
+            &GPU::rasterize<5>, &GPU::rasterize<6>, &GPU::rasterize<7>, &GPU::rasterize<8>,
+    };
+
+    getVaryingLayout(this->P->Programs[this->P->active], this->varyingLayout);
+
+    uint32_t count = this->varyingLayout.count;
+    this->rasterKernel = count <= MAX_SPECIALIZED_VARYINGS ? kernels[count] : &GPU::rasterize<-1>;
+}
+
+void GPU::getVaryingLayout(GPU::programSettingStructure *program, GPU::varyingLayoutStructure &layout) {
+    layout.count = 0;
+
+    for (uint8_t i = 0; i < maxAttributes; i++) {
+        auto components = (uint8_t) program->v2f[i];
+
+        for (uint8_t k = 0; k < components; k++) {
+            layout.attribute[layout.count] = i;
+            layout.component[layout.count] = k;
+            layout.count++;
+        }
+    }
+}
+
+void GPU::initTiles() {
+    this->tiles.clear();
+
+    if (this->FB->color == nullptr or this->FB->depth == nullptr) return;
+
+    uint32_t width = this->FB->width;
+    uint32_t height = this->FB->height;
+
+    for (uint32_t y = 0; y < height; y += this->tileSize) {
+        for (uint32_t x = 0; x < width; x += this->tileSize) {
+            tileStructure tile;
+            tile.left_down[0] = x;
+            tile.left_down[1] = y;
+            tile.right_top[0] = std::min(x + this->tileSize, width) - 1;
+            tile.right_top[1] = std::min(y + this->tileSize, height) - 1;
+            this->tiles.push_back(tile);
         }
-//        getAssembly(current_program, current_puller, tr_num, a);
-        assemblies.push_back(a);
     }
+}
+
+void GPU::initHiZ(float depth) {
+    this->hiZ.blocks_x = (this->FB->width + coverageBlockSize - 1) / coverageBlockSize;
+    this->hiZ.large_x = (this->FB->width + LARGE_BLOCK - 1) / LARGE_BLOCK;
+
+    uint32_t blocks_y = (this->FB->height + coverageBlockSize - 1) / coverageBlockSize;
+    uint32_t large_y = (this->FB->height + LARGE_BLOCK - 1) / LARGE_BLOCK;
+
+    // infinity is a valid bound for a depth buffer with unknown content
+    this->hiZ.blocks.assign(this->hiZ.blocks_x * blocks_y, depth);
+    this->hiZ.large.assign(this->hiZ.large_x * large_y, depth);
+}
+
+void GPU::resolveClearBlock(uint64_t x, uint64_t y) {
+    uint8_t &cleared = this->fastClear.blocks[(y / coverageBlockSize) * this->hiZ.blocks_x + x / coverageBlockSize];
+    if (!cleared) return;
+    cleared = 0;
+
+    uint64_t width = this->FB->width;
+    uint64_t height = this->FB->height;
+    uint64_t end_x = std::min(x + coverageBlockSize, width);
 
-    // clipping
-    clipped_assemblies.reserve(assemblies.size() * 2);
-    getTypes(current_puller, attribute_types);
+    auto *color = (uint32_t *) this->FB->color;
 
-    for (auto assembly: assemblies) {
-        auto new_assemblies = clipAssembly(assembly, attribute_types);
-        clipped_assemblies.insert(clipped_assemblies.end(), new_assemblies.begin(), new_assemblies.end());
+    // micro-tile of the tiled layout is contiguous
+    if (this->FB->tiled) {
+        uint64_t first = pixelOffset(x, y);
+        uint64_t last = first + coverageBlockSize * coverageBlockSize;
+        std::fill(color + first, color + last, this->fastClear.color);
+        fillDepthKey(first, last, this->fastClear.depth);
+        return;
     }
 
-    // perspective division
-    for (uint64_t i = 0; i < clipped_assemblies.size(); i++) {
-        perspectiveDivision(clipped_assemblies[i]);
+    for (uint64_t py = y; py < std::min(y + coverageBlockSize, height); py++) {
+        std::fill(color + py * width + x, color + py * width + end_x, this->fastClear.color);
+        fillDepthKey(py * width + x, py * width + end_x, this->fastClear.depth);
     }
+}
+
+void GPU::resolveFastClear() {
+    if (!this->fastClear.pending) return;
+    this->fastClear.pending = false;
+
+    uint64_t width = this->FB->width;
+    uint64_t height = this->FB->height;
+    uint64_t blocks_x = this->hiZ.blocks_x;
+    auto *color = (uint32_t *) this->FB->color;
+
+    // runs of untouched blocks in a block row are filled row by row with one fill per run
+    for (uint64_t by = 0; by * coverageBlockSize < height; by++) {
+        uint8_t *row = this->fastClear.blocks.data() + by * blocks_x;
+
+        for (uint64_t first = 0; first < blocks_x;) {
+            if (!row[first]) {
+                first++;
+                continue;
+            }
+
+            uint64_t last = first;
+            while (last < blocks_x and row[last]) row[last++] = 0;
+
+            uint64_t x0 = first * coverageBlockSize;
+            uint64_t x1 = std::min(last * coverageBlockSize, width);
+            uint64_t y1 = std::min((by + 1) * coverageBlockSize, height);
+
+            // run of micro-tiles is contiguous in the tiled layout
+            if (this->FB->tiled) {
+                uint64_t begin = pixelOffset(x0, by * coverageBlockSize);
+                uint64_t end = begin + (last - first) * coverageBlockSize * coverageBlockSize;
+                std::fill(color + begin, color + end, this->fastClear.color);
+                fillDepthKey(begin, end, this->fastClear.depth);
+                first = last;
+                continue;
+            }
+
+            for (uint64_t py = by * coverageBlockSize; py < y1; py++) {
+                std::fill(color + py * width + x0, color + py * width + x1, this->fastClear.color);
+                fillDepthKey(py * width + x0, py * width + x1, this->fastClear.depth);
+            }
 
-    // viewport transformation
-    for (uint64_t i = 0; i < clipped_assemblies.size(); i++) {
-        viewPortTransformation(clipped_assemblies[i], frame_width, frame_height);
+            first = last;
+        }
     }
+}
+
+void GPU::updateHiZ(uint64_t x, uint64_t y) {
+    uint64_t width = this->FB->width;
+    uint64_t height = this->FB->height;
 
-    // rasterization
-    for (auto assembly: clipped_assemblies) {
-        new_in_fragments = rasterize(assembly, current_program->v2f);
-        in_fragments.insert(in_fragments.end(), new_in_fragments.begin(), new_in_fragments.end());
+    float max_depth = -INFINITY;
+    for (uint64_t py = y; py < std::min(y + coverageBlockSize, height); py++) {
+        for (uint64_t px = x; px < std::min(x + coverageBlockSize, width); px++) {
+            uint64_t offset = pixelOffset(px, py);
+            float key = this->FB->depth_format == DepthFormat::D32F ? ((float const *) this->FB->depth)[offset]
+                                                                      : loadDepthKey(offset);
+            max_depth = std::max(max_depth, key);
+        }
     }
+    this->hiZ.blocks[(y / coverageBlockSize) * this->hiZ.blocks_x + x / coverageBlockSize] = max_depth;
+
+    // 32x32 level is built from the 8x8 level
+    uint32_t ratio = LARGE_BLOCK / coverageBlockSize;
+    uint64_t first_x = x / LARGE_BLOCK * ratio;
+    uint64_t first_y = y / LARGE_BLOCK * ratio;
+    uint64_t end_x = std::min(first_x + ratio, (uint64_t) this->hiZ.blocks_x);
+    uint64_t end_y = std::min(first_y + ratio, (uint64_t) this->hiZ.blocks.size() / this->hiZ.blocks_x);
+
+    max_depth = -INFINITY;
+    for (uint64_t by = first_y; by < end_y; by++) {
+        for (uint64_t bx = first_x; bx < end_x; bx++) {
+            max_depth = std::max(max_depth, this->hiZ.blocks[by * this->hiZ.blocks_x + bx]);
+        }
+    }
+    this->hiZ.large[(y / LARGE_BLOCK) * this->hiZ.large_x + x / LARGE_BLOCK] = max_depth;
+}
 
-    // fragment processor + per fragment
-    for (auto &in_frag: in_fragments) {
-        current_program->fs(out_frag, in_frag, *(current_program->uni));
-        putPixel((uint32_t) in_frag.gl_FragCoord[0], (uint32_t) in_frag.gl_FragCoord[1], out_frag.gl_FragColor,
-                 in_frag.gl_FragCoord[2]);
+void GPU::binTriangles(std::vector<triangleSetupStructure> &triangles) {
+    for (auto &tile: this->tiles) {
+        tile.triangles.clear();
     }
-//    printf("Frag count: ");
-//    std::cout << in_fragments.size() << "\n";
+
+    if (this->tiles.empty()) return;
+
+    uint32_t width = this->FB->width;
+    uint32_t height = this->FB->height;
+    uint32_t tiles_x = (width + this->tileSize - 1) / this->tileSize;
+
+    for (uint32_t i = 0; i < triangles.size(); i++) {
+        triangleSetupStructure &triangle = triangles[i];
+        if (!triangle.visible) continue;
+
+        if (triangle.right_top[0] < 0 or triangle.right_top[1] < 0) continue;
+        if (triangle.left_down[0] >= width or triangle.left_down[1] >= height) continue;
+
+        auto first_x = (uint32_t) std::max(triangle.left_down[0], (int64_t) 0) / this->tileSize;
+        auto first_y = (uint32_t) std::max(triangle.left_down[1], (int64_t) 0) / this->tileSize;
+        auto last_x = (uint32_t) std::min(triangle.right_top[0], (int64_t) width - 1) / this->tileSize;
+        auto last_y = (uint32_t) std::min(triangle.right_top[1], (int64_t) height - 1) / this->tileSize;
+
+        for (uint32_t ty = first_y; ty <= last_y; ty++) {
+            for (uint32_t tx = first_x; tx <= last_x; tx++) {
+                this->tiles[ty * tiles_x + tx].triangles.push_back(i);
+            }
+        }
+    }
+}
+
+// quads are aligned to even pixels, so the lane follows from parity of the fragment coordinates
+static uint32_t getQuadLane(InFragment const &fragment) {
+    return ((uint32_t) fragment.gl_FragCoord[0] & 1) | ((uint32_t) fragment.gl_FragCoord[1] & 1) << 1;
+}
+
+/**
+ * @brief This function returns change of fragment attribute towards the right neighbour in the 2x2 quad.
+ * It can be called only from fragment shader on the fragment it was invoked with.
+ *
+ * @param fragment input fragment of the fragment shader
+ * @param attribute index of attribute
+ *
+ * @return difference of the attribute between right and left column of the quad, in the row of the fragment
+ */
+glm::vec4 dFdx(InFragment const &fragment, uint32_t attribute) {
+    uint32_t lane = getQuadLane(fragment);
+    InFragment const *quad = &fragment - lane;
+    return quad[lane | 1].attributes[attribute].v4 - quad[lane & 2].attributes[attribute].v4;
+}
+
+/**
+ * @brief This function returns change of fragment attribute towards the upper neighbour in the 2x2 quad.
+ * It can be called only from fragment shader on the fragment it was invoked with.
+ *
+ * @param fragment input fragment of the fragment shader
+ * @param attribute index of attribute
+ *
+ * @return difference of the attribute between upper and lower row of the quad, in the column of the fragment
+ */
+glm::vec4 dFdy(InFragment const &fragment, uint32_t attribute) {
+    uint32_t lane = getQuadLane(fragment);
+    InFragment const *quad = &fragment - lane;
+    return quad[lane | 2].attributes[attribute].v4 - quad[lane & 1].attributes[attribute].v4;
+}
+
+void GPU::flushFragments(GPU::fragmentQueueStructure &queue) {
+    if (queue.program->fsBatch != nullptr) {
+        flushFragmentBatches(queue);
+        return;
+    }
+
+    OutFragment out_frag{};
+    for (uint8_t i = 0; i < 4; i++) {
+        out_frag.gl_FragColor[i] = 0;
+    }
+
+    varyingLayoutStructure const &layout = *queue.layout;
+    uint32_t lane_stride = 4 + layout.count;
+
+    // lanes of the quad are unpacked into consecutive InFragments, helper lanes included,
+    // so dFdx and dFdy can reach the neighbours of the shaded fragment
+    InFragment quad_frags[4];
+
+    // colors of the quad are collected per channel and packed together,
+    // helper and depth-failed lanes keep defined values that writeQuad discards
+    float channels[4][4] = {};
+    float const *channel_rows[4] = {channels[0], channels[1], channels[2], channels[3]};
+    uint32_t pixels[4];
+
+    size_t quads = queue.fragments.size() / queue.stride;
+    for (size_t q = 0; q < quads; q++) {
+        float const *quad = queue.fragments.data() + q * queue.stride;
+        auto lanes = (uint32_t) quad[0];
+
+        float const *frags[4];
+        for (uint8_t l = 0; l < 4; l++) {
+            frags[l] = quad + 1 + l * lane_stride;
+        }
+
+        for (uint8_t l = 0; l < 4; l++) {
+            float const *data = frags[l];
+            InFragment &in_frag = quad_frags[l];
+
+            for (uint8_t i = 0; i < 4; i++) {
+                in_frag.gl_FragCoord[i] = data[i];
+            }
+            for (uint32_t i = 0; i < layout.count; i++) {
+                in_frag.attributes[layout.attribute[i]].v4[layout.component[i]] = data[4 + i];
+            }
+        }
+
+        for (uint8_t l = 0; l < 4; l++) {
+            if (!(lanes >> l & 1)) continue;
+
+            queue.program->fs(out_frag, quad_frags[l], *(queue.program->uni));
+            for (uint8_t c = 0; c < 4; c++) {
+                channels[c][l] = out_frag.gl_FragColor[c];
+            }
+        }
+
+        packColors(channel_rows, 4, pixels);
+        writeQuad((uint64_t) frags[0][0], (uint64_t) frags[0][1], lanes, pixels);
+    }
+
+    queue.fragments.clear();
+    queue.count = 0;
+}
+
+
+void GPU::flushFragmentBatches(GPU::fragmentQueueStructure &queue) {
+    varyingLayoutStructure const &layout = *queue.layout;
+    uint32_t lane_stride = 4 + layout.count;
+    uint32_t const lanes = fragmentBatchLanes;
+
+    // one array of lanes per component: gl_FragCoord, varyings, their derivatives and output colors
+    queue.batch.resize((4 + 3 * layout.count + 4) * lanes);
+    float *coords = queue.batch.data();
+    float *varyings = coords + 4 * lanes;
+    float *dx = varyings + layout.count * lanes;
+    float *dy = dx + layout.count * lanes;
+    float *colors = dy + layout.count * lanes;
+
+    InFragmentBatch in_batch{};
+    OutFragmentBatch out_batch{};
+    uint32_t pixels[fragmentBatchLanes];
+    for (uint8_t i = 0; i < 4; i++) {
+        in_batch.gl_FragCoord[i] = coords + i * lanes;
+        out_batch.gl_FragColor[i] = colors + i * lanes;
+    }
+    for (uint32_t i = 0; i < layout.count; i++) {
+        uint8_t attribute = layout.attribute[i];
+        uint8_t component = layout.component[i];
+        in_batch.attributes[attribute][component] = varyings + i * lanes;
+        in_batch.dFdx[attribute][component] = dx + i * lanes;
+        in_batch.dFdy[attribute][component] = dy + i * lanes;
+    }
+
+    size_t quads = queue.fragments.size() / queue.stride;
+    for (size_t first = 0; first < quads; first += lanes / 4) {
+        auto batch_quads = (uint32_t) std::min(quads - first, (size_t) lanes / 4);
+
+        in_batch.count = 4 * batch_quads;
+        in_batch.coverage = 0;
+
+        // quads are transposed into the structure of arrays
+        for (uint32_t q = 0; q < batch_quads; q++) {
+            float const *quad = queue.fragments.data() + (first + q) * queue.stride;
+            in_batch.coverage |= (uint64_t) quad[0] << (4 * q);
+
+            float const *frags[4];
+            for (uint8_t l = 0; l < 4; l++) {
+                frags[l] = quad + 1 + l * lane_stride;
+            }
+
+            for (uint8_t l = 0; l < 4; l++) {
+                uint32_t lane = 4 * q + l;
+                float const *left = frags[l & 2], *right = frags[l | 1];
+                float const *bottom = frags[l & 1], *top = frags[l | 2];
+
+                for (uint8_t i = 0; i < 4; i++) {
+                    coords[i * lanes + lane] = frags[l][i];
+                }
+                for (uint32_t i = 0; i < layout.count; i++) {
+                    varyings[i * lanes + lane] = frags[l][4 + i];
+                    dx[i * lanes + lane] = right[4 + i] - left[4 + i];
+                    dy[i * lanes + lane] = top[4 + i] - bottom[4 + i];
+                }
+            }
+        }
+
+        queue.program->fsBatch(out_batch, in_batch, *(queue.program->uni));
+
+        // whole batch is converted at once, quads are merged with their coverage masks
+        packColors(out_batch.gl_FragColor, in_batch.count, pixels);
+        for (uint32_t q = 0; q < batch_quads; q++) {
+            auto quad_lanes = (uint32_t) (in_batch.coverage >> (4 * q) & 0xf);
+            writeQuad((uint64_t) coords[4 * q], (uint64_t) coords[lanes + 4 * q], quad_lanes, pixels + 4 * q);
+        }
+    }
+
+    queue.fragments.clear();
+    queue.count = 0;
 }
 
 
@@ -1046,52 +2200,63 @@ void GPU::resizeVP(GPU::vertexPullersStructure *VPS) {
     VPS->Pullers = new_pullers;
 }
 
-void GPU::pullVP(GPU::vertexPullerSettingStructure *puller, uint32_t inv_index, InVertex *inv) {
-    if (puller == nullptr) return;
+// index fetch routines of the fetch plan
+static uint32_t fetchLinearIndex(void const *, uint32_t i) {
+    return i;
+}
+
+template<typename T>
+static uint32_t fetchIndexOf(void const *indices, uint32_t i) {
+    return ((T const *) indices)[i];
+}
 
-    bool indexing = puller->indexing->enabled;
-    uint32_t index;
+void GPU::compileFetchPlan(GPU::vertexPullerSettingStructure *puller, GPU::fetchPlanStructure &plan) {
+    plan.heads = 0;
+    plan.indices = nullptr;
+    plan.fetchIndex = fetchLinearIndex;
 
     for (uint32_t i = 0; i < maxAttributes; i++) {
-        if (indexing) {
-            uint8_t index_8;
-            uint16_t index_16;
-            uint32_t index_32;
-
-            switch (puller->indexing->type) {
-                case IndexType::UINT8:
-                    this->getDataBS(this->Buffer, puller->indexing->buffer, sizeof(index_8) * inv_index,
-                                    sizeof(index_8),
-                                    &index_8);
-                    index = index_8;
-                    break;
-                case IndexType::UINT16:
-                    this->getDataBS(this->Buffer, puller->indexing->buffer, sizeof(index_16) * inv_index,
-                                    sizeof(index_16),
-                                    &index_16);
-                    index = index_16;
-                    break;
-                case IndexType::UINT32:
-                    this->getDataBS(this->Buffer, puller->indexing->buffer, sizeof(index_32) * inv_index,
-                                    sizeof(index_32),
-                                    &index_32);
-                    index = index_32;
-                    break;
-            }
+        headStructure const &head = *(puller->heads[i]);
+        if (!head.enabled or head.type == AttributeType::EMPTY) continue;
+        if (head.buffer >= this->Buffer->bufferSize or this->Buffer->bufferArray[head.buffer] == nullptr) continue;
+
+        fetchHeadStructure &fetch = plan.head[plan.heads++];
+        fetch.base = (uint8_t const *) this->Buffer->bufferArray[head.buffer] + head.offset;
+        fetch.stride = head.stride;
+        fetch.size = (uint32_t) head.type * sizeof(float);
+        fetch.attribute = i;
+    }
 
-        } else {
-            index = inv_index;
-        }
+    indexingStructure const &indexing = *(puller->indexing);
+    if (!indexing.enabled) return;
+    if (indexing.buffer >= this->Buffer->bufferSize or this->Buffer->bufferArray[indexing.buffer] == nullptr) return;
 
-        inv->gl_VertexID = index;
+    plan.indices = this->Buffer->bufferArray[indexing.buffer];
+    switch (indexing.type) {
+        case IndexType::UINT8:
+            plan.fetchIndex = fetchIndexOf<uint8_t>;
+            break;
+        case IndexType::UINT16:
+            plan.fetchIndex = fetchIndexOf<uint16_t>;
+            break;
+        case IndexType::UINT32:
+            plan.fetchIndex = fetchIndexOf<uint32_t>;
+            break;
+    }
+}
 
-        headStructure head = *(puller->heads[i]);
-        if (!head.enabled) continue;
+void GPU::fetchVertex(GPU::fetchPlanStructure const &plan, uint32_t index, InVertex *inv) {
+    inv->gl_VertexID = index;
 
-        uint64_t size = (uint64_t) head.type * sizeof(float);
-        if (size == 0) continue;
+    for (uint32_t h = 0; h < plan.heads; h++) {
+        fetchHeadStructure const &head = plan.head[h];
+        memcpy(&(inv->attributes[head.attribute]), head.base + head.stride * index, head.size);
+    }
+}
 
-        this->getDataBS(this->Buffer, head.buffer, head.offset + head.stride * index, size, &(inv->attributes[i]));
+void GPU::prefetchVertex(GPU::fetchPlanStructure const &plan, uint32_t index) {
+    for (uint32_t h = 0; h < plan.heads; h++) {
+        __builtin_prefetch(plan.head[h].base + plan.head[h].stride * index);
     }
 }
 
@@ -1146,105 +2311,306 @@ uint8_t GPU::convertColor(float value) {
     return value;
 }
 
-void GPU::getAssembly(GPU::programSettingStructure *program, GPU::vertexPullerSettingStructure *puller,
-                      uint32_t triangle_num, GPU::Assembly &a) {
-    InVertex *iv;
-    OutVertex *ov;
-
-    for (uint32_t i = 0; i < 3; i++) {
-        this->pullVP(puller, 3 * triangle_num + i, iv);
-        program->vs(*ov, *iv, *(program->uni));
-        a.ov[i] = *ov;
+void GPU::parallelChunks(uint32_t count, std::function<void(uint32_t, uint32_t)> const &job) {
+    if (this->pool == nullptr or count <= VERTEX_CHUNK) {
+        job(0, count);
+        return;
     }
-}
 
-void GPU::getTypes(GPU::vertexPullerSettingStructure *puller, AttributeType *attribute_types) {
-    for (uint8_t i = 0; i < maxAttributes; i++) {
-        if (puller->heads[i]->enabled) {
-            attribute_types[i] = puller->heads[i]->type;
-        } else {
-            attribute_types[i] = AttributeType::EMPTY;
+    uint32_t chunks = (count + VERTEX_CHUNK - 1) / VERTEX_CHUNK;
+    this->pool->parallelFor(chunks, [&](uint32_t chunk, uint32_t) {
+        job(chunk * VERTEX_CHUNK, std::min((chunk + 1) * VERTEX_CHUNK, count));
+    });
+}
+
+void GPU::processVertices(GPU::programSettingStructure *program, GPU::fetchPlanStructure const &plan,
+                          uint32_t first, uint32_t count, GPU::Assembly *assemblies) {
+    // every invocation writes only its own slot, so the result does not depend on the scheduling
+    parallelChunks(count, [&](uint32_t begin, uint32_t end) {
+        if (program->vsBatch != nullptr) {
+            uint32_t indices[vertexBatchLanes];
+            OutVertex *outputs[vertexBatchLanes];
+
+            for (uint32_t i = begin; i < end; i += vertexBatchLanes) {
+                uint32_t lanes = std::min(end - i, vertexBatchLanes);
+                for (uint32_t l = 0; l < lanes; l++) {
+                    indices[l] = plan.fetchIndex(plan.indices, first + i + l);
+                    outputs[l] = &assemblies[(i + l) / 3].ov[(i + l) % 3];
+                }
+                // vertices of the next batch are fetched while this one is shaded
+                for (uint32_t l = i + lanes; l < std::min(end, i + lanes + vertexBatchLanes); l++) {
+                    prefetchVertex(plan, plan.fetchIndex(plan.indices, first + l));
+                }
+                shadeVertexBatch(program, plan, indices, lanes, outputs);
+            }
+            return;
         }
+
+        InVertex iv{};
+        for (uint32_t i = begin; i < end; i++) {
+            if (i + FETCH_DISTANCE < end) {
+                prefetchVertex(plan, plan.fetchIndex(plan.indices, first + i + FETCH_DISTANCE));
+            }
+
+            OutVertex &ov = assemblies[i / 3].ov[i % 3];
+            fetchVertex(plan, plan.fetchIndex(plan.indices, first + i), &iv);
+            ov = OutVertex{};
+            program->vs(ov, iv, *(program->uni));
+        }
+    });
+}
+
+bool GPU::beginVertexCache(GPU::fetchPlanStructure const &plan, uint32_t count) {
+    vertexCacheStructure &cache = this->vertexCache;
+
+    if (count == 0) return false;
+
+    uint32_t min_index = UINT32_MAX;
+    uint32_t max_index = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = plan.fetchIndex(plan.indices, i);
+        min_index = std::min(min_index, index);
+        max_index = std::max(max_index, index);
+    }
+
+    // sparse indices would allocate slots that are never used, such draws are shaded without the cache
+    uint64_t range = (uint64_t) max_index - min_index + 1;
+    if (range > std::max(count, VERTEX_CACHE_RANGE)) return false;
+
+    // memory left by a much larger draw is released
+    if (cache.tags.capacity() > 4 * range) {
+        std::vector<uint32_t>().swap(cache.tags);
+        std::vector<OutVertex>().swap(cache.vertices);
+    }
+
+    cache.base = min_index;
+    cache.tags.resize(range, 0);
+    cache.vertices.resize(range);
+
+    cache.draw++;
+    if (cache.draw == 0) {
+        std::fill(cache.tags.begin(), cache.tags.end(), 0);
+        cache.draw = 1;
     }
+
+    return true;
 }
 
-std::vector<GPU::Assembly> GPU::clipAssembly(GPU::Assembly as, AttributeType types[maxAttributes]) {
-    std::vector<Assembly> out_av;
+void GPU::shadeVertexBatch(GPU::programSettingStructure *program, GPU::fetchPlanStructure const &plan,
+                           uint32_t const *indices, uint32_t count, OutVertex *const *outputs) {
+    uint32_t const lanes = vertexBatchLanes;
 
-    std::vector<OutVertex> OK_points;
-    std::vector<OutVertex> F_points;
+    // one array of lanes per attribute component
+    float in_data[maxAttributes * 4][lanes];
+    float out_data[(maxAttributes + 1) * 4][lanes];
 
-    for (uint8_t i = 0; i < 3; i++) {
-        if (-as.ov[i].gl_Position[3] <= as.ov[i].gl_Position[2]) {
-            OK_points.push_back(as.ov[i]);
-        } else {
-            F_points.push_back(as.ov[i]);
-        }
+    InVertexBatch in_batch{};
+    in_batch.count = count;
+    in_batch.gl_VertexID = indices;
+
+    // gather kernels always read full batch, unused lanes repeat the first vertex
+    uint32_t lane_indices[lanes];
+    for (uint32_t l = 0; l < lanes; l++) {
+        lane_indices[l] = indices[l < count ? l : 0];
     }
 
-    if (OK_points.empty()) {
-        return out_av;
+    // attributes are gathered straight from the buffer memory, interleaved (AoS) vertices are transposed
+    for (uint32_t h = 0; h < plan.heads; h++) {
+        fetchHeadStructure const &head = plan.head[h];
+        uint32_t i = head.attribute;
+        uint32_t components = head.size / sizeof(float);
+
+        this->gatherKernel(head.base, head.stride, components, lane_indices, count, &in_data[i * 4]);
+        for (uint32_t c = 0; c < components; c++) {
+            in_batch.attributes[i][c] = in_data[i * 4 + c];
+        }
     }
 
-    if (OK_points.size() == 3) {
-        out_av.push_back(as);
-        return out_av;
+    // outputs start with the same values as OutVertex{}
+    OutVertexBatch out_batch{};
+    for (uint32_t i = 0; i < maxAttributes; i++) {
+        for (uint32_t c = 0; c < 4; c++) {
+            out_batch.attributes[i][c] = out_data[i * 4 + c];
+            std::fill(out_data[i * 4 + c], out_data[i * 4 + c] + count, 1.f);
+        }
+    }
+    for (uint32_t c = 0; c < 4; c++) {
+        out_batch.gl_Position[c] = out_data[maxAttributes * 4 + c];
+        std::fill(out_batch.gl_Position[c], out_batch.gl_Position[c] + count, 0.f);
     }
 
-    if (OK_points.size() == 2) {
-        for (uint8_t i = 0; i < maxAttributes; i++) {
-            if (types[i] == AttributeType::EMPTY) continue;
+    program->vsBatch(out_batch, in_batch, *(program->uni));
+
+    // only attributes interpolated into fragments are scattered back
+    for (uint32_t l = 0; l < count; l++) {
+        OutVertex &ov = *outputs[l];
+        for (uint32_t c = 0; c < 4; c++) {
+            ov.gl_Position[c] = out_batch.gl_Position[c][l];
+        }
+        for (uint32_t i = 0; i < maxAttributes; i++) {
+            for (uint32_t c = 0; c < (uint32_t) program->v2f[i]; c++) {
+                ov.attributes[i].v4[c] = out_batch.attributes[i][c][l];
+            }
         }
+    }
+}
+
+void GPU::processIndexedVertices(GPU::programSettingStructure *program, GPU::fetchPlanStructure const &plan,
+                                 uint32_t first, uint32_t count, GPU::Assembly *assemblies) {
+    vertexCacheStructure &cache = this->vertexCache;
 
-        auto new_point_0 = countOutVer(OK_points[0], F_points[0], types);
-        auto new_point_1 = countOutVer(OK_points[1], F_points[0], types);
+    cache.indices.resize(count);
+    cache.misses.clear();
 
-        Assembly ass;
-        ass.ov[0] = OK_points[0];
-        ass.ov[1] = new_point_0;
-        ass.ov[2] = new_point_1;
-        out_av.push_back(ass);
+    // lookup, every vertex that is not in the cache yet is scheduled for shading exactly once
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = plan.fetchIndex(plan.indices, first + i);
+        uint32_t slot = index - cache.base;
+        cache.indices[i] = slot;
 
-        ass.ov[0] = OK_points[0];
-        ass.ov[1] = OK_points[1];
-        ass.ov[2] = new_point_1;
-        out_av.push_back(ass);
+        if (cache.tags[slot] == cache.draw) {
+            cache.hits++;
+        } else {
+            cache.tags[slot] = cache.draw;
+            cache.misses.push_back(index);
+        }
     }
+    cache.lookups += count;
+
+    parallelChunks((uint32_t) cache.misses.size(), [&](uint32_t begin, uint32_t end) {
+        if (program->vsBatch != nullptr) {
+            OutVertex *outputs[vertexBatchLanes];
+
+            for (uint32_t i = begin; i < end; i += vertexBatchLanes) {
+                uint32_t lanes = std::min(end - i, vertexBatchLanes);
+                for (uint32_t l = 0; l < lanes; l++) {
+                    outputs[l] = &cache.vertices[cache.misses[i + l] - cache.base];
+                }
+                // vertices of the next batch are fetched while this one is shaded
+                for (uint32_t l = i + lanes; l < std::min(end, i + lanes + vertexBatchLanes); l++) {
+                    prefetchVertex(plan, cache.misses[l]);
+                }
+                shadeVertexBatch(program, plan, cache.misses.data() + i, lanes, outputs);
+            }
+            return;
+        }
+
+        InVertex iv{};
+        for (uint32_t i = begin; i < end; i++) {
+            if (i + FETCH_DISTANCE < end) prefetchVertex(plan, cache.misses[i + FETCH_DISTANCE]);
 
-    if (OK_points.size() == 1) {
-        auto new_point_0 = countOutVer(OK_points[0], F_points[0], types);
-        auto new_point_1 = countOutVer(OK_points[0], F_points[1], types);
+            uint32_t index = cache.misses[i];
+            OutVertex &ov = cache.vertices[index - cache.base];
+            fetchVertex(plan, index, &iv);
+            ov = OutVertex{};
+            program->vs(ov, iv, *(program->uni));
+        }
+    });
 
-        Assembly ass;
-        ass.ov[0] = OK_points[0];
-        ass.ov[1] = new_point_0;
-        ass.ov[2] = new_point_1;
-        out_av.push_back(ass);
+    // primitive assembly
+    for (uint32_t i = 0; i < count; i++) {
+        assemblies[i / 3].ov[i % 3] = cache.vertices[cache.indices[i]];
     }
+}
+
+uint32_t GPU::getClipCode(glm::vec4 const &position, glm::vec2 view_extent, glm::vec2 guard_band) {
+    float x = position[0];
+    float y = position[1];
+    float z = position[2];
+    float w = position[3];
+
+    uint32_t code = 0;
 
-    return out_av;
+    if (x < -view_extent[0] * w) code |= CLIP_LEFT;
+    if (x > view_extent[0] * w) code |= CLIP_RIGHT;
+    if (y < -view_extent[1] * w) code |= CLIP_BOTTOM;
+    if (y > view_extent[1] * w) code |= CLIP_TOP;
+    if (z < -w) code |= CLIP_NEAR;
+    if (z > w) code |= CLIP_FAR;
+
+    if (x < -guard_band[0] * w) code |= CLIP_GUARD_LEFT;
+    if (x > guard_band[0] * w) code |= CLIP_GUARD_RIGHT;
+    if (y < -guard_band[1] * w) code |= CLIP_GUARD_BOTTOM;
+    if (y > guard_band[1] * w) code |= CLIP_GUARD_TOP;
+
+    return code;
 }
 
+void GPU::clipAssembly(GPU::Assembly const &as, GPU::varyingLayoutStructure const &layout, glm::vec2 guard_band,
+                       std::vector<Assembly> &out) {
+    // vertex is inside when dot(plane, position) >= 0
+    glm::vec4 planes[5] = {
+            glm::vec4(0.f, 0.f, 1.f, 1.f),
+            glm::vec4(1.f, 0.f, 0.f, guard_band[0]),
+            glm::vec4(-1.f, 0.f, 0.f, guard_band[0]),
+            glm::vec4(0.f, 1.f, 0.f, guard_band[1]),
+            glm::vec4(0.f, -1.f, 0.f, guard_band[1]),
+    };
+
+    OutVertex buffers[2][MAX_CLIP_VERTICES];
+    OutVertex *polygon = buffers[0];
+    OutVertex *clipped = buffers[1];
+
+    uint32_t size = 3;
+    for (uint8_t i = 0; i < 3; i++) {
+        polygon[i] = as.ov[i];
+    }
 
-OutVertex GPU::countOutVer(OutVertex A_OV, OutVertex B_OV, AttributeType types[maxAttributes]) {
-    OutVertex O_OV;
+    // Sutherland-Hodgman, polygon keeps winding of the triangle
+    for (auto &plane: planes) {
+        float distances[MAX_CLIP_VERTICES];
+        bool outside = false;
+        for (uint32_t i = 0; i < size; i++) {
+            distances[i] = glm::dot(plane, polygon[i].gl_Position);
+            outside = outside or !(distances[i] >= 0);
+        }
+        if (!outside) continue;
 
-    int zp = 2;
-    int wp = 3;
+        uint32_t clipped_size = 0;
 
-    auto A = A_OV.gl_Position;
-    auto B = B_OV.gl_Position;
+        for (uint32_t i = 0; i < size; i++) {
+            uint32_t j = (i + 1) % size;
 
-    float t = (-A[wp] - A[zp]) / (B[wp] - A[wp] + B[zp] - A[zp]);
+            float dP = distances[i];
+            float dQ = distances[j];
 
-    O_OV.gl_Position = countLinCombination(A, B, t);
+            if (dP >= 0) clipped[clipped_size++] = polygon[i];
+            if ((dP >= 0) == (dQ >= 0)) continue;
 
-    for (uint8_t i = 0; i < maxAttributes; i++) {
-        if (types[i] == AttributeType::EMPTY) continue;
-        O_OV.attributes[i] = countLinCombination(A_OV.attributes[i], B_OV.attributes[i], t, types[i]);
+            // intersection is always computed from the inner vertex, so shared edges are clipped identically
+            if (dP >= 0) {
+                countOutVer(polygon[i], polygon[j], layout, dP / (dP - dQ), clipped[clipped_size++]);
+            } else {
+                countOutVer(polygon[j], polygon[i], layout, dQ / (dQ - dP), clipped[clipped_size++]);
+            }
+        }
+
+        std::swap(polygon, clipped);
+        size = clipped_size;
+        if (size < 3) return;
     }
 
-    return O_OV;
+    // triangle fan goes straight to the next stage
+    for (uint32_t i = 1; i + 1 < size; i++) {
+        out.emplace_back();
+        Assembly &ass = out.back();
+        ass.ov[0] = polygon[0];
+        ass.ov[1] = polygon[i];
+        ass.ov[2] = polygon[i + 1];
+    }
+}
+
+
+void GPU::countOutVer(OutVertex const &A_OV, OutVertex const &B_OV, GPU::varyingLayoutStructure const &layout,
+                      float t, OutVertex &O_OV) {
+    O_OV.gl_Position = countLinCombination(A_OV.gl_Position, B_OV.gl_Position, t);
+
+    // only components that reach the fragment shader are interpolated
+    for (uint32_t i = 0; i < layout.count; i++) {
+        uint8_t a = layout.attribute[i];
+        uint8_t c = layout.component[i];
+        O_OV.attributes[a].v4[c] = countLinCombination(A_OV.attributes[a].v4[c], B_OV.attributes[a].v4[c], t);
+    }
 }
 
 float GPU::countLinCombination(float A, float B, float t) {
@@ -1311,234 +2677,570 @@ void GPU::viewPortTransformation(Assembly &ass, float width, float height) {
     }
 }
 
-std::vector<InFragment> GPU::rasterize(GPU::Assembly ass, AttributeType *v2s_types) {
+bool GPU::setupTriangle(GPU::Assembly &ass, GPU::varyingLayoutStructure const &layout,
+                        GPU::triangleSetupStructure &setup) {
+    glm::vec4 &A = ass.ov[0].gl_Position;
+    glm::vec4 &B = ass.ov[1].gl_Position;
+    glm::vec4 &C = ass.ov[2].gl_Position;
+
+    setup.visible = setupEdges(A, B, C, setup.edges, setup.left_down, setup.right_top);
+    if (!setup.visible) return false;
+
+    setup.origin[0] = A[0];
+    setup.origin[1] = A[1];
+
+    float e1x = B[0] - A[0];
+    float e1y = B[1] - A[1];
+    float e2x = C[0] - A[0];
+    float e2y = C[1] - A[1];
+
+    float det = e1x * e2y - e2x * e1y;
+    float inv_det = det != 0 ? 1.f / det : 0.f;
+
+    // plane going through values a, b, c in vertices A, B, C
+    auto getPlane = [&](float a, float b, float c) {
+        planeStructure plane;
+        plane.dx = ((b - a) * e2y - (c - a) * e1y) * inv_det;
+        plane.dy = ((c - a) * e1x - (b - a) * e2x) * inv_det;
+        plane.origin = a;
+        return plane;
+    };
+
+    float inv_w[3];
+    for (uint8_t i = 0; i < 3; i++) {
+        inv_w[i] = 1.f / ass.ov[i].gl_Position[3];
+    }
+
+    setup.inv_w = getPlane(inv_w[0], inv_w[1], inv_w[2]);
+    setup.z = getPlane(A[2] * inv_w[0], B[2] * inv_w[1], C[2] * inv_w[2]);
+
+    // interpolated depth can round a few ulps past the vertex depths and snapped edges cover pixel centers up to
+    // the snapping error outside of the triangle, where the depth is extrapolated; the bound keeps a margin for both
+    // so hierarchical depth test never rejects a passing fragment
+    float max_abs_z = std::max(std::max(std::fabs(A[2]), std::fabs(B[2])), std::fabs(C[2]));
+    float min_inv_w = std::min(std::min(inv_w[0], inv_w[1]), inv_w[2]);
+    float extent = 0;
+    for (auto P: {&A, &B, &C}) {
+        extent = std::max(extent, std::max(std::fabs((*P)[0]), std::fabs((*P)[1])));
+    }
+    // setupEdges lowers the precision of huge triangles, so the snapping error is bounded by both terms
+    float snap = std::max(std::ldexp(1.f, -(int32_t) (this->subpixelBits + 1)), std::ldexp(extent, -29));
+    // gradient of perspective correct depth z / w over 1 / w is bounded by the gradients of both planes,
+    // the margin is doubled because 1 / w keeps shrinking outside of the triangle
+    float slope = (std::fabs(setup.z.dx) + std::fabs(setup.z.dy) +
+                   max_abs_z * (std::fabs(setup.inv_w.dx) + std::fabs(setup.inv_w.dy))) / min_inv_w;
+    setup.min_z = std::min(std::min(A[2], B[2]), C[2]) - std::ldexp(max_abs_z, -18) - 2 * snap * slope;
+
+    for (uint32_t i = 0; i < layout.count; i++) {
+        uint8_t a = layout.attribute[i];
+        uint8_t c = layout.component[i];
+        setup.varyings[i] = getPlane(ass.ov[0].attributes[a].v4[c] * inv_w[0], ass.ov[1].attributes[a].v4[c] * inv_w[1],
+                                     ass.ov[2].attributes[a].v4[c] * inv_w[2]);
+    }
+
+    return true;
+}
+
+bool GPU::isCulled(GPU::Assembly &ass) {
+    glm::vec4 &A = ass.ov[0].gl_Position;
+    glm::vec4 &B = ass.ov[1].gl_Position;
+    glm::vec4 &C = ass.ov[2].gl_Position;
+
+    // twice the signed area in window coordinates, positive for counter-clockwise triangles
+    float area = (B[0] - A[0]) * (C[1] - A[1]) - (C[0] - A[0]) * (B[1] - A[1]);
+
+    // zero area triangles cover no pixels, NaN positions are rejected too
+    if (area == 0 or std::isnan(area)) return true;
+
+    if (this->cullFace == CullFace::NONE) return false;
+    if (this->cullFace == CullFace::FRONT_AND_BACK) return true;
+
+    bool front = (area > 0) == (this->frontFace == FrontFace::CCW);
+    return front ? this->cullFace == CullFace::FRONT : this->cullFace == CullFace::BACK;
+}
+
+template<int32_t VARYINGS>
+void GPU::rasterize(GPU::triangleSetupStructure const &triangle, GPU::varyingLayoutStructure const &layout,
+                    GPU::tileStructure const &area, GPU::fragmentQueueStructure &queue) {
     uint8_t xp = 0, yp = 1, zp = 2, hp = 3;
 
-    glm::vec4 *A, *B, *C;
-    A = &(ass.ov[0].gl_Position);
-    B = &(ass.ov[1].gl_Position);
-    C = &(ass.ov[2].gl_Position);
+    if (!triangle.visible) return;
 
-    Attribute *at_A, *at_B, *at_C;
-    at_A = ass.ov[0].attributes;
-    at_B = ass.ov[1].attributes;
-    at_C = ass.ov[2].attributes;
+    edgeSetupStructure const &setup = triangle.edges;
 
     uint64_t left_down[2];
     uint64_t right_top[2];
-    getConvexCover(*A, *B, *C, left_down, right_top);
-
-    std::vector<glm::vec2> deltas;
-    getDeltas(*A, *B, *C, deltas);
-
-    glm::vec3 edges;
-    edgeFunction(*A, *B, *C, deltas, left_down[xp], left_down[yp], edges);
-
-    glm::vec3 lambdas;
-    glm::vec3 homogenous((*A)[hp], (*B)[hp], (*C)[hp]);
-
-    std::vector<InFragment> fragments;
-    InFragment frag;
-
-    float w5, h5;
-
-    for (uint64_t h = left_down[yp]; h <= right_top[yp]; h++) {
-        for (uint64_t w = left_down[xp]; w <= right_top[xp]; w++) {
-            w5 = 0.5f + w;
-            h5 = 0.5f + h;
-
-            edgeFunction(*A, *B, *C, deltas, w5, h5, edges);
-
-            if ((edges[0] >= 0 and edges[1] >= 0 and edges[2] >= 0)) {
-
-                getBarycentricCoordinates(*A, *B, *C, glm::vec2(w5, h5), lambdas);
-
-                frag.gl_FragCoord[xp] = w5;
-                frag.gl_FragCoord[yp] = h5;
-
-                frag.gl_FragCoord[zp] = perspectiveCorrection(lambdas, homogenous, (*A)[zp], (*B)[zp], (*C)[zp]);
-                frag.gl_FragCoord[hp] = perspectiveCorrection(lambdas, homogenous, (*A)[hp], (*B)[hp], (*C)[hp]);
-
-//                if (this->test_num == 22 and std::abs(30.f - w) <= 1.5 and std::abs(h - 20.f) <= 1.5) {
-//                    printf("** lambdas ");
-//                    for (uint8_t i = 0; i < 3; i++) {
-//                        printf(" %f ", lambdas[i]);
-//                    }
-//                    printf("\n");
-//                }
-
-                for (uint8_t i = 0; i < maxAttributes; i++) {
-                    switch (v2s_types[i]) {
-                        case AttributeType::EMPTY:
-                            break;
-                        case AttributeType::FLOAT:
-                            frag.attributes[i].v1 = perspectiveCorrection(lambdas, homogenous, at_A[i].v1,
-                                                                          at_B[i].v1, at_C[i].v1);
-                            break;
-                        case AttributeType::VEC2:
-                            frag.attributes[i].v2 = perspectiveCorrection(lambdas, homogenous, at_A[i].v2,
-                                                                          at_B[i].v2, at_C[i].v2);
-                            break;
-                        case AttributeType::VEC3:
-                            frag.attributes[i].v3 = perspectiveCorrection(lambdas, homogenous, at_A[i].v3,
-                                                                          at_B[i].v3, at_C[i].v3);
-                            break;
-                        case AttributeType::VEC4:
-
-                            frag.attributes[i].v4 = perspectiveCorrection(lambdas, homogenous, at_A[i].v4,
-                                                                          at_B[i].v4, at_C[i].v4);
-                        default:
-
-                            break;
+    for (uint8_t i = 0; i < 2; i++) {
+        int64_t low = std::max(triangle.left_down[i], (int64_t) area.left_down[i]);
+        int64_t high = std::min(triangle.right_top[i], (int64_t) area.right_top[i]);
+        if (low > high) return;
+
+        left_down[i] = low;
+        right_top[i] = high;
+    }
+
+    // fragment shader can not change depth, so the depth test runs before the fragment is queued
+    bool depth_test = this->depthState.test;
+    bool depth_write = this->depthState.write;
+    uint64_t width = getFramebufferWidth();
+    bool tiled = this->FB->tiled;
+
+    // float depth is compared directly, other formats are converted to keys in the depth test
+    float *float_depth = this->FB->depth_format == DepthFormat::D32F ? (float *) this->FB->depth : nullptr;
+
+    // perspective correct depth lies between depths of the vertices, so blocks whose stored depth
+    // is everywhere nearer than the lower bound of the triangle are rejected by the hierarchical depth buffer
+    DepthFunction depth_func = this->depthState.func;
+    bool hi_z = depth_test and (depth_func == DepthFunction::LESS or depth_func == DepthFunction::LEQUAL);
+
+    float min_key = depthKey(triangle.min_z);
+
+    auto occluded = [&](float max_depth) {
+        if (!hi_z) return false;
+        return depth_func == DepthFunction::LESS ? min_key >= max_depth : min_key > max_depth;
+    };
+
+    // fragments are emitted in aligned 2x2 quads, so the fragment stage can take derivatives of varyings,
+    // lanes of the quad that are not covered are helper lanes, they are interpolated but not shaded
+    // returns true when depth buffer was written
+    auto emitFragments = [&](uint64_t bx, uint64_t by, uint64_t mask) {
+        bool written = false;
+
+        // left bottom pixel of every quad that contains at least one covered pixel
+        uint64_t quads = (mask | mask >> 1 | mask >> coverageBlockSize | mask >> (coverageBlockSize + 1)) &
+                         0x0055005500550055;
+
+        while (quads != 0) {
+            uint32_t bit = __builtin_ctzll(quads);
+            quads &= quads - 1;
+
+            uint32_t lanes = (mask >> bit & 3) | (mask >> (bit + coverageBlockSize) & 3) << 2;
+
+            uint64_t qx = bx + bit % coverageBlockSize;
+            uint64_t qy = by + bit / coverageBlockSize;
+
+            // lane l lies in pixel (qx + l % 2, qy + l / 2)
+            float x[4], y[4], z[4], w[4];
+            for (uint8_t l = 0; l < 4; l++) {
+                x[l] = 0.5f + (qx + l % 2) - triangle.origin[0];
+                y[l] = 0.5f + (qy + l / 2) - triangle.origin[1];
+
+                // the only division per pixel
+                w[l] = 1.f / (triangle.inv_w.origin + triangle.inv_w.dx * x[l] + triangle.inv_w.dy * y[l]);
+                z[l] = (triangle.z.origin + triangle.z.dx * x[l] + triangle.z.dy * y[l]) * w[l];
+            }
+
+            if (depth_test) {
+                // lanes of an aligned quad are consecutive in the Morton order of the tiled layout
+                uint64_t quad_offset = pixelOffset(qx, qy);
+                for (uint8_t l = 0; l < 4; l++) {
+                    if (!(lanes >> l & 1)) continue;
+
+                    uint64_t offset = quad_offset + (tiled ? l : (l / 2) * width + l % 2);
+                    float key = float_depth != nullptr ? z[l] : depthKey(z[l]);
+                    float buffer_key = float_depth != nullptr ? float_depth[offset] : loadDepthKey(offset);
+                    if (!passDepthTest(key, buffer_key)) {
+                        // failed lane stays in the quad as a helper lane
+                        lanes &= ~(1u << l);
+                        continue;
                     }
+                    if (depth_write) {
+                        if (float_depth != nullptr) {
+                            float_depth[offset] = key;
+                        } else {
+                            storeDepthKey(offset, key);
+                        }
+                        written = true;
+                    }
+                }
+                if (lanes == 0) continue;
+            }
+
+            float *quad = pushQuad(queue, __builtin_popcount(lanes));
+            quad[0] = (float) lanes;
+
+            // loop is unrolled for specialized kernels
+            uint32_t varyings = VARYINGS < 0 ? layout.count : (uint32_t) VARYINGS;
+            for (uint8_t l = 0; l < 4; l++) {
+                float *frag = quad + 1 + l * (4 + varyings);
+                frag[xp] = 0.5f + (qx + l % 2);
+                frag[yp] = 0.5f + (qy + l / 2);
+                frag[zp] = z[l];
+                frag[hp] = w[l];
+
+                for (uint32_t i = 0; i < varyings; i++) {
+                    planeStructure const &plane = triangle.varyings[i];
+                    frag[4 + i] = (plane.origin + plane.dx * x[l] + plane.dy * y[l]) * w[l];
                 }
-                fragments.push_back(frag);
             }
         }
-    }
 
-    return fragments;
-}
+        return written;
+    };
+
+    // 8x8 block: rejected or accepted as a whole, per pixel tests only for partially covered blocks
+    auto rasterizeBlock = [&](uint64_t bx, uint64_t by, int64_t const edges[3], BlockCoverage coverage) {
+        uint64_t mask = getAreaMask(bx, by, left_down, right_top);
+        if (mask == 0) return;
 
+        if (occluded(this->hiZ.blocks[(by / coverageBlockSize) * this->hiZ.blocks_x + bx / coverageBlockSize])) {
+            return;
+        }
+
+        if (coverage == BlockCoverage::PARTIAL) {
+            coverage = classifyBlock(setup, edges, coverageBlockSize);
+        }
 
-void GPU::getConvexCover(glm::vec4 A, glm::vec4 B, glm::vec4 C, uint64_t left_down[], uint64_t right_top[]) {
-    float left_down_float[2];
-    float right_top_float[2];
+        if (coverage == BlockCoverage::OUTSIDE) return;
 
-    for (uint8_t i = 0; i < 2; i++) {
-        left_down_float[i] = std::min(std::min(A[i], B[i]), C[i]);
-        right_top[i] = std::max(std::max(A[i], B[i]), C[i]);
+        if (coverage == BlockCoverage::PARTIAL) {
+            mask &= this->coverageKernel(setup, edges);
+        }
+
+        resolveClearBlock(bx, by);
+        if (emitFragments(bx, by, mask)) updateHiZ(bx, by);
+    };
+
+    // edges are stepped from block to block, they are evaluated directly only in the first block
+    auto rasterizeBlocks = [&](uint64_t x0, uint64_t y0, uint64_t x1, uint64_t y1, int64_t const start[3],
+                               BlockCoverage coverage) {
+        int64_t row[3] = {start[0], start[1], start[2]};
+
+        for (uint64_t by = y0; by <= y1; by += coverageBlockSize) {
+            int64_t edges[3] = {row[0], row[1], row[2]};
+
+            for (uint64_t bx = x0; bx <= x1; bx += coverageBlockSize) {
+                rasterizeBlock(bx, by, edges, coverage);
+                edgesRight(edges, setup, coverageBlockSize);
+            }
+
+            edgesUp(row, setup, coverageBlockSize);
+        }
+    };
 
-        left_down_float[i] = std::max(left_down_float[i], 0.f);
-        left_down_float[i] = std::max(left_down_float[i], 0.f);
+    uint64_t block_mask = ~(uint64_t) (coverageBlockSize - 1);
+    uint64_t large_mask = ~(uint64_t) (LARGE_BLOCK - 1);
 
+    // triangles that fit into 4x4 pixels are tested pixel by pixel without the block traversal
+    if (right_top[xp] - left_down[xp] < SMALL_TRIANGLE and right_top[yp] - left_down[yp] < SMALL_TRIANGLE) {
+        int64_t row[3];
+        getEdges(row, setup, left_down[xp], left_down[yp]);
+
+        // mask is relative to the quad aligned origin
+        uint64_t origin_x = left_down[xp] & ~(uint64_t) 1;
+        uint64_t origin_y = left_down[yp] & ~(uint64_t) 1;
+
+        uint64_t mask = 0;
+        for (uint64_t y = left_down[yp] - origin_y; y <= right_top[yp] - origin_y; y++) {
+            int64_t edges[3] = {row[0], row[1], row[2]};
+
+            for (uint64_t x = left_down[xp] - origin_x; x <= right_top[xp] - origin_x; x++) {
+                if ((edges[0] | edges[1] | edges[2]) >= 0) mask |= (uint64_t) 1 << (y * coverageBlockSize + x);
+                edgesRight(edges, setup, 1);
+            }
+
+            edgesUp(row, setup, 1);
+        }
+
+        // area can overlap up to four 8x8 blocks, pixels of occluded blocks are dropped
+        for (uint64_t by = left_down[yp] & block_mask; by <= right_top[yp]; by += coverageBlockSize) {
+            for (uint64_t bx = left_down[xp] & block_mask; bx <= right_top[xp]; bx += coverageBlockSize) {
+                uint64_t block = (by / coverageBlockSize) * this->hiZ.blocks_x + bx / coverageBlockSize;
+                if (!occluded(this->hiZ.blocks[block])) continue;
+
+                uint64_t x0 = std::max(bx, origin_x) - origin_x;
+                uint64_t x1 = std::min(bx + coverageBlockSize, origin_x + coverageBlockSize) - origin_x;
+                uint64_t y0 = std::max(by, origin_y) - origin_y;
+                uint64_t y1 = std::min(by + coverageBlockSize, origin_y + coverageBlockSize) - origin_y;
+
+                uint64_t columns = ((uint64_t) 1 << x1) - ((uint64_t) 1 << x0);
+                for (uint64_t y = y0; y < y1; y++) mask &= ~(columns << (y * coverageBlockSize));
+            }
+        }
+
+        if (mask == 0) return;
+
+        for (uint64_t by = left_down[yp] & block_mask; by <= right_top[yp]; by += coverageBlockSize) {
+            for (uint64_t bx = left_down[xp] & block_mask; bx <= right_top[xp]; bx += coverageBlockSize) {
+                resolveClearBlock(bx, by);
+            }
+        }
+
+        if (!emitFragments(origin_x, origin_y, mask)) return;
+
+        for (uint64_t by = left_down[yp] & block_mask; by <= right_top[yp]; by += coverageBlockSize) {
+            for (uint64_t bx = left_down[xp] & block_mask; bx <= right_top[xp]; bx += coverageBlockSize) {
+                updateHiZ(bx, by);
+            }
+        }
+        return;
     }
 
-    right_top_float[0] = std::min(right_top_float[0], (float) getFramebufferWidth() - 1);
-    right_top_float[1] = std::min(right_top_float[1], (float) getFramebufferHeight() - 1);
+    // small triangles are traversed by 8x8 blocks directly
+    if (right_top[xp] - left_down[xp] < LARGE_BLOCK and right_top[yp] - left_down[yp] < LARGE_BLOCK) {
+        uint64_t x0 = left_down[xp] & block_mask;
+        uint64_t y0 = left_down[yp] & block_mask;
 
-    for (uint8_t i = 0; i < 2; i++) {
-        left_down[i] = floor(left_down_float[i] + 0.5);
-        right_top_float[i] = floor(right_top_float[i] + 0.5);
+        int64_t start[3];
+        getEdges(start, setup, x0, y0);
+        rasterizeBlocks(x0, y0, right_top[xp], right_top[yp], start, BlockCoverage::PARTIAL);
+        return;
     }
-}
 
-void GPU::getDeltas(glm::vec4 A, glm::vec4 B, glm::vec4 C, std::vector<glm::vec2> &deltas) {
-    glm::vec2 delta;
+    // large triangles are tested by 32x32 blocks first
+    uint64_t lx0 = left_down[xp] & large_mask;
+    uint64_t ly0 = left_down[yp] & large_mask;
 
-    delta[0] = A[0] - B[0];
-    delta[1] = A[1] - B[1];
-    deltas.push_back(delta);
+    int64_t large_row[3];
+    getEdges(large_row, setup, lx0, ly0);
 
-    delta[0] = B[0] - C[0];
-    delta[1] = B[1] - C[1];
-    deltas.push_back(delta);
+    for (uint64_t ly = ly0; ly <= right_top[yp]; ly += LARGE_BLOCK) {
+        int64_t large_edges[3] = {large_row[0], large_row[1], large_row[2]};
+
+        for (uint64_t lx = lx0; lx <= right_top[xp]; lx += LARGE_BLOCK) {
+            BlockCoverage coverage = BlockCoverage::OUTSIDE;
+            if (!occluded(this->hiZ.large[(ly / LARGE_BLOCK) * this->hiZ.large_x + lx / LARGE_BLOCK])) {
+                coverage = classifyBlock(setup, large_edges, LARGE_BLOCK);
+            }
+
+            if (coverage != BlockCoverage::OUTSIDE) {
+                uint64_t x0 = std::max(lx, left_down[xp] & block_mask);
+                uint64_t y0 = std::max(ly, left_down[yp] & block_mask);
+
+                int64_t start[3] = {large_edges[0], large_edges[1], large_edges[2]};
+                edgesRight(start, setup, x0 - lx);
+                edgesUp(start, setup, y0 - ly);
+
+                rasterizeBlocks(x0, y0, std::min(lx + LARGE_BLOCK - 1, right_top[xp]),
+                                std::min(ly + LARGE_BLOCK - 1, right_top[yp]), start, coverage);
+            }
+
+            edgesRight(large_edges, setup, LARGE_BLOCK);
+        }
 
-    delta[0] = C[0] - A[0];
-    delta[1] = C[1] - A[1];
-    deltas.push_back(delta);
+        edgesUp(large_row, setup, LARGE_BLOCK);
+    }
 }
 
-void GPU::edgeFunction(glm::vec4 A, glm::vec4 B, glm::vec4 C, std::vector<glm::vec2> &deltas, float x, float y,
-                       glm::vec3 &edges) {
+bool GPU::setupEdges(glm::vec4 A, glm::vec4 B, glm::vec4 C, edgeSetupStructure &setup, int64_t left_down[],
+                     int64_t right_top[]) {
+    glm::vec4 points[3] = {A, B, C};
+
+    // snapped coordinates have to stay below 2^29, so the edge products fit into 64 bits
+    float limit = (float) (1 << 29);
+
+    float extent = 0;
+    for (auto &P: points) {
+        extent = std::max(extent, std::max(std::abs(P[0]), std::abs(P[1])));
+    }
+    if (!(extent < limit / 2)) return false;
 
-    uint8_t xp = 0, yp = 1;
-    std::vector<glm::vec4> points;
+    // precision is lowered for huge triangles
+    int32_t bits = (int32_t) this->subpixelBits;
+    while (bits > 1 and std::ldexp(extent, bits) >= limit) bits--;
 
-    points.push_back(A);
-    points.push_back(B);
-    points.push_back(C);
+    int64_t one = (int64_t) 1 << bits;
+    int64_t half = one >> 1;
 
+    int64_t x[3];
+    int64_t y[3];
     for (uint8_t i = 0; i < 3; i++) {
-        edges[i] = (x - points[i][xp]) * deltas[i][yp] - (y - points[i][yp]) * deltas[i][xp];
+        x[i] = std::llround(std::ldexp(points[i][0], bits));
+        y[i] = std::llround(std::ldexp(points[i][1], bits));
     }
 
-    if (edges[0] <= 0 and edges[1] <= 0 and edges[2] <= 0) {
-        for (uint8_t i = 0; i < 3; i++) {
-            edges[i] = edges[i] * -1;
-            deltas[i][0] = deltas[i][0] * -1;
-            deltas[i][1] = deltas[i][1] * -1;
-        }
-    }
-}
+    // pixels whose centers lie inside the bounding box of snapped vertices
+    left_down[0] = (*std::min_element(x, x + 3) - half + one - 1) >> bits;
+    left_down[1] = (*std::min_element(y, y + 3) - half + one - 1) >> bits;
+    right_top[0] = (*std::max_element(x, x + 3) - half) >> bits;
+    right_top[1] = (*std::max_element(y, y + 3) - half) >> bits;
 
-void
-GPU::getBarycentricCoordinates(glm::vec4 A, glm::vec4 B, glm::vec4 C, glm::vec2 Point, glm::vec3 &Coordinates) {
-    Coordinates[0] = countCoordinates(A, B, C, Point);
-    Coordinates[1] = countCoordinates(B, C, A, Point);
-    Coordinates[2] = countCoordinates(C, A, B, Point);
-}
+    // tiny triangles between pixel centers cover no sample
+    if (left_down[0] > right_top[0] or left_down[1] > right_top[1]) return false;
 
-float GPU::countCoordinates(glm::vec4 A, glm::vec4 B, glm::vec4 C, glm::vec2 Point) {
-    uint8_t x = 0, y = 1;
+    // twice the signed area, inside of the triangle has to be positive
+    int64_t area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (area == 0) return false;
+    int64_t sign = area < 0 ? -1 : 1;
 
-    float res = ((B[y] - C[y]) * (Point[x] - C[x]) + (C[x] - B[x]) * (Point[y] - C[y])) /
-                ((B[y] - C[y]) * (A[x] - C[x]) + (C[x] - B[x]) * (A[y] - C[y]));
+    for (uint8_t i = 0; i < 3; i++) {
+        uint8_t j = (i + 1) % 3;
 
-    if (res < 0)
-        return res = res * -1;
+        int64_t step_x = (y[i] - y[j]) * sign;
+        int64_t step_y = (x[j] - x[i]) * sign;
 
-    return res;
-}
+        // top-left rule: samples exactly on the edge belong only to left edges and to horizontal top edges
+        bool top_left = step_x > 0 or (step_x == 0 and step_y < 0);
+        int64_t bias = top_left ? 0 : -1;
 
-float GPU::perspectiveCorrection(glm::vec3 Coordinates, glm::vec3 h, float a1, float a2, float a3) {
-    float jmenovatel = 0;
-    float delitel = 0;
+        setup.a[i] = step_x * one;
+        setup.b[i] = step_y * one;
+        setup.c[i] = step_x * (half - x[i]) + step_y * (half - y[i]) + bias;
+        setup.range[i] = (coverageBlockSize - 1) * (std::abs(setup.a[i]) + std::abs(setup.b[i]));
+    }
 
-    glm::vec3 Attributes{a1, a2, a3};
+    return true;
+}
 
+void GPU::getEdges(int64_t edges[], edgeSetupStructure const &setup, uint64_t x, uint64_t y) {
     for (uint8_t i = 0; i < 3; i++) {
-        jmenovatel += Attributes[i] * Coordinates[i] / h[i];
-        delitel += Coordinates[i] / h[i];
+        edges[i] = setup.a[i] * (int64_t) x + setup.b[i] * (int64_t) y + setup.c[i];
     }
-    return jmenovatel / delitel;
 }
 
-glm::vec2 GPU::perspectiveCorrection(glm::vec3 Coordinates, glm::vec3 h, glm::vec2 a1, glm::vec2 a2, glm::vec2 a3) {
-    glm::vec2 res;
-    for (uint8_t i = 0; i < 2; i++) {
-        res[i] = perspectiveCorrection(Coordinates, h, a1[i], a2[i], a3[i]);
+void GPU::edgesRight(int64_t edges[], edgeSetupStructure const &setup, uint64_t pixels) {
+    for (uint8_t i = 0; i < 3; i++) {
+        edges[i] += setup.a[i] * (int64_t) pixels;
     }
-    return res;
 }
 
-glm::vec3 GPU::perspectiveCorrection(glm::vec3 Coordinates, glm::vec3 h, glm::vec3 a1, glm::vec3 a2, glm::vec3 a3) {
-    glm::vec3 res;
+void GPU::edgesUp(int64_t edges[], edgeSetupStructure const &setup, uint64_t pixels) {
     for (uint8_t i = 0; i < 3; i++) {
-        res[i] = perspectiveCorrection(Coordinates, h, a1[i], a2[i], a3[i]);
+        edges[i] += setup.b[i] * (int64_t) pixels;
     }
-    return res;
 }
 
-glm::vec4 GPU::perspectiveCorrection(glm::vec3 Coordinates, glm::vec3 h, glm::vec4 a1, glm::vec4 a2, glm::vec4 a3) {
-    glm::vec4 res;
-    for (uint8_t i = 0; i < 4; i++) {
-        res[i] = perspectiveCorrection(Coordinates, h, a1[i], a2[i], a3[i]);
+uint64_t GPU::getAreaMask(uint64_t x, uint64_t y, uint64_t left_down[], uint64_t right_top[]) {
+    uint64_t columns = 0xff;
+    uint64_t rows = ~(uint64_t) 0;
+
+    if (x < left_down[0]) columns &= 0xff << (left_down[0] - x);
+    if (x + coverageBlockSize - 1 > right_top[0]) columns &= 0xff >> (x + coverageBlockSize - 1 - right_top[0]);
+
+    if (y < left_down[1]) rows <<= coverageBlockSize * (left_down[1] - y);
+    if (y + coverageBlockSize - 1 > right_top[1]) rows >>= coverageBlockSize * (y + coverageBlockSize - 1 - right_top[1]);
+
+    return (columns * 0x0101010101010101ull) & rows;
+}
+
+bool GPU::passDepthTest(float depth, float buffer_depth) {
+    switch (this->depthState.func) {
+        case DepthFunction::NEVER:
+            return false;
+        case DepthFunction::LESS:
+            return depth < buffer_depth;
+        case DepthFunction::EQUAL:
+            return depth == buffer_depth;
+        case DepthFunction::LEQUAL:
+            return depth <= buffer_depth;
+        case DepthFunction::GREATER:
+            return depth > buffer_depth;
+        case DepthFunction::NOTEQUAL:
+            return depth != buffer_depth;
+        case DepthFunction::GEQUAL:
+            return depth >= buffer_depth;
+        case DepthFunction::ALWAYS:
+            return true;
     }
-    return res;
+    return true;
 }
 
+// unorm keys are exact integers in float, so keys grow with depth
+float GPU::depthKey(float z) {
+    switch (this->FB->depth_format) {
+        case DepthFormat::D16:
+            return (float) (uint32_t) (std::min(std::max((z + 1.f) * 0.5f, 0.f), 1.f) * (float) UINT16_MAX + 0.5f);
+        case DepthFormat::D24: {
+            // 0xffffff + 0.5 is not representable in float, rounding is done in double and clamped,
+            // so far depths do not overflow the 24 bits
+            double unorm = std::min(std::max((z + 1.0) * 0.5, 0.0), 1.0) * (double) 0xffffff + 0.5;
+            return (float) std::min((uint32_t) unorm, (uint32_t) 0xffffff);
+        }
+        default:
+            return z;
+    }
+}
 
-void GPU::putPixel(uint32_t x, uint32_t y, glm::vec4 color, float depth) {
+float GPU::loadDepthKey(uint64_t offset) {
+    switch (this->FB->depth_format) {
+        case DepthFormat::D16:
+            return ((uint16_t const *) this->FB->depth)[offset];
+        case DepthFormat::D24: {
+            uint8_t const *bytes = this->FB->depth + 3 * offset;
+            return (float) (bytes[0] | bytes[1] << 8 | bytes[2] << 16);
+        }
+        default:
+            return ((float const *) this->FB->depth)[offset];
+    }
+}
 
-    uint8_t *color_buffer = this->getFramebufferColor();
-    float *depth_buffer = this->getFramebufferDepth();
+void GPU::storeDepthKey(uint64_t offset, float key) {
+    switch (this->FB->depth_format) {
+        case DepthFormat::D16:
+            ((uint16_t *) this->FB->depth)[offset] = (uint16_t) key;
+            break;
+        case DepthFormat::D24: {
+            // 3 bytes per pixel, least significant byte first
+            auto value = (uint32_t) key;
+            uint8_t *bytes = this->FB->depth + 3 * offset;
+            bytes[0] = (uint8_t) value;
+            bytes[1] = (uint8_t) (value >> 8);
+            bytes[2] = (uint8_t) (value >> 16);
+            break;
+        }
+        default:
+            ((float *) this->FB->depth)[offset] = key;
+            break;
+    }
+}
 
-    uint64_t position = getFramebufferWidth() * y + x;
-    float buffer_depth;
+void GPU::fillDepthKey(uint64_t begin, uint64_t end, float key) {
+    switch (this->FB->depth_format) {
+        case DepthFormat::D16:
+            std::fill((uint16_t *) this->FB->depth + begin, (uint16_t *) this->FB->depth + end, (uint16_t) key);
+            break;
+        case DepthFormat::D24:
+            for (uint64_t offset = begin; offset < end; offset++) {
+                storeDepthKey(offset, key);
+            }
+            break;
+        default:
+            std::fill((float *) this->FB->depth + begin, (float *) this->FB->depth + end, key);
+            break;
+    }
+}
 
-    memcpy(&buffer_depth, depth_buffer + (position * DepthPixelS), DepthPixelS);
+float GPU::depthFromKey(float key) {
+    switch (this->FB->depth_format) {
+        case DepthFormat::D16:
+            return key / (float) UINT16_MAX * 2.f - 1.f;
+        case DepthFormat::D24:
+            return key / (float) 0xffffff * 2.f - 1.f;
+        default:
+            return key;
+    }
+}
 
-    // if (depth >= buffer_depth) return;
+// output merger: writes packed RGBA8 pixels of the 2x2 quad at (x, y), only lanes set in the mask are stored
+void GPU::writeQuad(uint64_t x, uint64_t y, uint32_t lanes, uint32_t const pixels[4]) {
+    auto *color = (uint32_t *) this->FB->color;
 
-    uint8_t new_color[4];
-    for (uint8_t i = 0; i < 4; i++) {
-        new_color[i] = convertColor(color[i]);
+    // whole quad is one 16 byte store in the tiled layout, one 8 byte store per row in the linear layout
+    if (this->FB->tiled) {
+        uint32_t *quad = color + pixelOffset(x, y);
+        if (lanes == 0xf) {
+            memcpy(quad, pixels, 4 * sizeof(uint32_t));
+            return;
+        }
+        for (uint8_t l = 0; l < 4; l++) {
+            if (lanes >> l & 1) quad[l] = pixels[l];
+        }
+        return;
     }
 
-    memcpy(color_buffer + (position * ColorPixelS), new_color, ColorPixelS);
-    memcpy(depth_buffer + (position * DepthPixelS), &depth, DepthPixelS);
+    for (uint8_t r = 0; r < 2; r++) {
+        uint32_t row_lanes = lanes >> (2 * r) & 3;
+        if (row_lanes == 0) continue;
 
+        uint32_t *row = color + pixelOffset(x, y + r);
+        if (row_lanes == 3) {
+            memcpy(row, pixels + 2 * r, 2 * sizeof(uint32_t));
+        } else if (row_lanes == 1) {
+            row[0] = pixels[2 * r];
+        } else {
+            row[1] = pixels[2 * r + 1];
+        }
+    }
 }
 
 
@@ -9,6 +9,215 @@
 #include <student/fwd.hpp>
 #include "vector"
 #include "stack"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief This enum represents comparison function of the depth test
+ */
+enum class DepthFunction {
+    NEVER = 0, ///< fragment never passes
+    LESS = 1, ///< fragment passes if its depth is less than the stored depth
+    EQUAL = 2, ///< fragment passes if its depth is equal to the stored depth
+    LEQUAL = 3, ///< fragment passes if its depth is less than or equal to the stored depth
+    GREATER = 4, ///< fragment passes if its depth is greater than the stored depth
+    NOTEQUAL = 5, ///< fragment passes if its depth is not equal to the stored depth
+    GEQUAL = 6, ///< fragment passes if its depth is greater than or equal to the stored depth
+    ALWAYS = 7, ///< fragment always passes
+};
+
+/**
+ * @brief This enum represents storage format of the depth buffer
+ */
+enum class DepthFormat {
+    D32F = 0, ///< 32-bit float
+    D16 = 1, ///< 16-bit unsigned normalized
+    D24 = 2, ///< 24-bit unsigned normalized packed in 3 bytes
+};
+
+/**
+ * @brief This enum represents faces that are culled
+ */
+enum class CullFace {
+    NONE = 0, ///< no triangle is culled
+    FRONT = 1, ///< front facing triangles are culled
+    BACK = 2, ///< back facing triangles are culled
+    FRONT_AND_BACK = 3, ///< all triangles are culled
+};
+
+/**
+ * @brief This enum represents winding of front facing triangles in window coordinates
+ */
+enum class FrontFace {
+    CCW = 0, ///< counter-clockwise triangles are front facing
+    CW = 1, ///< clockwise triangles are front facing
+};
+
+// screen space derivatives of fragment attributes, fragments are shaded in aligned 2x2 quads
+glm::vec4 dFdx(InFragment const &fragment, uint32_t attribute);
+
+glm::vec4 dFdy(InFragment const &fragment, uint32_t attribute);
+
+uint32_t const vertexBatchLanes = 16; ///< maximum number of vertices in one vertex batch
+
+/**
+ * @brief This struct represents batch of input vertices in structure of arrays form.
+ */
+struct InVertexBatch {
+    uint32_t count; ///< number of lanes
+    uint32_t const *gl_VertexID; ///< vertex ids
+    float const *attributes[maxAttributes][4]; ///< vertex attributes, nullptr for components that are not pulled
+};
+
+/**
+ * @brief This struct represents batch of output vertices in structure of arrays form.
+ */
+struct OutVertexBatch {
+    float *attributes[maxAttributes][4]; ///< vertex attributes, one array per component
+    float *gl_Position[4]; ///< clip space positions, one array per component
+};
+
+/**
+ * @brief Function type for batched vertex shader
+ *
+ * @param outVertices output vertices
+ * @param inVertices input vertices
+ * @param uniforms uniform variables
+ */
+using VertexShaderBatch = void (*)(OutVertexBatch &outVertices, InVertexBatch const &inVertices,
+                                   Uniforms const &uniforms);
+
+uint32_t const fragmentBatchLanes = 64; ///< maximum number of fragments in one fragment batch
+
+/**
+ * @brief This struct represents batch of input fragments in structure of arrays form.
+ * Lanes are grouped into 2x2 quads, lane 4*q+l lies in pixel (l%2, l/2) of quad q.
+ * Lanes that are not set in the coverage mask are helper lanes, their colors are discarded.
+ */
+struct InFragmentBatch {
+    uint32_t count; ///< number of lanes (multiple of 4)
+    uint64_t coverage; ///< bit i is set when lane i is shaded
+    float const *gl_FragCoord[4]; ///< fragment coordinates, one array per component
+    float const *attributes[maxAttributes][4]; ///< fragment attributes, nullptr when not interpolated
+    float const *dFdx[maxAttributes][4]; ///< change of attributes towards the right neighbour in the 2x2 quad
+    float const *dFdy[maxAttributes][4]; ///< change of attributes towards the upper neighbour in the 2x2 quad
+};
+
+/**
+ * @brief This struct represents batch of output fragments in structure of arrays form.
+ */
+struct OutFragmentBatch {
+    float *gl_FragColor[4]; ///< fragment colors, one array per component
+};
+
+/**
+ * @brief Function type for batched fragment shader
+ *
+ * @param outFragments output fragments
+ * @param inFragments input fragments
+ * @param uniforms uniform variables
+ */
+using FragmentShaderBatch = void (*)(OutFragmentBatch &outFragments, InFragmentBatch const &inFragments,
+                                     Uniforms const &uniforms);
+
+/**
+ * @brief This struct contains fixed point edge coefficients of one triangle.
+ * Edge i in pixel (x, y) equals a[i] * x + b[i] * y + c[i],
+ * a sample is covered when all three edges are >= 0.
+ */
+struct edgeSetupStructure {
+    int64_t a[3]; ///< change of edge when moving one pixel right
+    int64_t b[3]; ///< change of edge when moving one pixel up
+    int64_t c[3]; ///< edge in center of pixel (0, 0) including bias of the top-left rule
+    int64_t range[3]; ///< maximal change of edge inside one 8x8 block
+};
+
+/**
+ * @brief Size of the block evaluated by one call of coverage kernel (8x8 pixels).
+ */
+uint32_t const coverageBlockSize = 8;
+
+/**
+ * @brief Function type of coverage kernel.
+ * Kernel evaluates pixel centers of 8x8 block, bit (row * 8 + column) of the result is set for covered pixels.
+ *
+ * @param setup edge coefficients
+ * @param edges edges in left bottom pixel of the block
+ */
+using CoverageKernel = uint64_t (*)(edgeSetupStructure const &setup, int64_t const edges[3]);
+
+/**
+ * @brief This enum represents result of the block test against triangle edges.
+ */
+enum class BlockCoverage {
+    OUTSIDE = 0, ///< no pixel of the block is covered
+    PARTIAL = 1, ///< block has to be tested per pixel
+    INSIDE = 2, ///< all pixels of the block are covered
+};
+
+BlockCoverage classifyBlock(edgeSetupStructure const &setup, int64_t const edges[3], uint32_t size);
+
+uint32_t getCoverageKernelWidth(uint32_t max_width);
+
+CoverageKernel getCoverageKernel(uint32_t width);
+
+void packColors(float const *const channels[4], uint32_t count, uint32_t *packed);
+
+/**
+ * @brief Function type of attribute gather kernel.
+ * Kernel transposes one attribute of a batch of interleaved (AoS) vertices into one array of lanes per component.
+ *
+ * @param base buffer memory including offset of the attribute
+ * @param stride distance between vertices in bytes
+ * @param components number of float components of the attribute
+ * @param indices vertexBatchLanes vertex indices, lanes past count repeat a valid index
+ * @param count number of used lanes
+ * @param out one array of vertexBatchLanes floats per component
+ */
+using GatherKernel = void (*)(uint8_t const *base, uint64_t stride, uint32_t components, uint32_t const *indices,
+                              uint32_t count, float (*out)[vertexBatchLanes]);
+
+GatherKernel getGatherKernel();
+
+/**
+ * @brief This class represents pool of worker threads
+ */
+class ThreadPool {
+public:
+    /**
+     * @brief Type of job, it gets index of the work item and id of the worker that runs it.
+     */
+    using Job = std::function<void(uint32_t index, uint32_t worker)>;
+
+    explicit ThreadPool(uint32_t threads);
+
+    ~ThreadPool();
+
+    uint32_t getSize() const;
+
+    void parallelFor(uint32_t count, Job const &job);
+
+private:
+    void workerLoop(uint32_t worker);
+
+    void runItems(uint32_t worker);
+
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    Job const *job = nullptr;
+    uint32_t count = 0;
+    std::atomic<uint32_t> next{0};
+    uint32_t running = 0;
+    uint64_t generation = 0;
+    bool stop = false;
+};
 
 
 /**
@@ -60,6 +269,12 @@ public:
 
     void attachShaders(ProgramID prg, VertexShader vs, FragmentShader fs);
 
+    void attachShaders(ProgramID prg, VertexShader vs, FragmentShaderBatch fs);
+
+    void attachShaders(ProgramID prg, VertexShaderBatch vs, FragmentShader fs);
+
+    void attachShaders(ProgramID prg, VertexShaderBatch vs, FragmentShaderBatch fs);
+
     void setVS2FSType(ProgramID prg, uint32_t attrib, AttributeType type);
 
     void useProgram(ProgramID prg);
@@ -77,7 +292,7 @@ public:
     void programUniformMatrix4f(ProgramID prg, uint32_t uniformId, glm::mat4 const &d);
 
     //framebuffer functions
-    void createFramebuffer(uint32_t width, uint32_t height);
+    void createFramebuffer(uint32_t width, uint32_t height, DepthFormat format = DepthFormat::D32F);
 
     void deleteFramebuffer();
 
@@ -91,11 +306,47 @@ public:
 
     uint32_t getFramebufferHeight();
 
+    DepthFormat getFramebufferDepthFormat();
+
+    void setFramebufferHugePages(bool enable);
+
+    void setFramebufferTiling(bool enable);
+
+    //depth test functions
+    void enableDepthTest();
+
+    void disableDepthTest();
+
+    void setDepthFunction(DepthFunction func);
+
+    void setDepthWriteMask(bool write);
+
+    void setClearDepth(float depth);
+
+    //face culling functions
+    void setCullFace(CullFace mode);
+
+    void setFrontFace(FrontFace face);
+
     //execution commands
     void clear(float r, float g, float b, float a);
 
     void drawTriangles(uint32_t nofVertices);
 
+    void setDrawBatchSize(uint32_t triangles, uint32_t fragments);
+
+    void setRasterThreads(uint32_t threads);
+
+    void setTileSize(uint32_t size);
+
+    void setCoverageKernelWidth(uint32_t width);
+
+    void setSubpixelBits(uint32_t bits);
+
+    float getVertexCacheHitRate();
+
+    void resetVertexCacheStats();
+
     /// \addtogroup gpu_init 00. proměnné, inicializace / deinicializace grafické karty
     /// @{
 
@@ -174,13 +425,37 @@ public:
 
     void resizeVP(vertexPullersStructure *VPS);
 
-    void pullVP(vertexPullerSettingStructure *puller, uint32_t inv_index, InVertex *inv);
+    // vertex fetch plan: enabled heads with resolved buffer pointers, compiled at every draw
+    struct fetchHeadStructure {
+        uint8_t const *base; ///< buffer memory including offset of the head
+        uint64_t stride;
+        uint32_t size; ///< bytes of one attribute
+        uint32_t attribute;
+    };
+
+    struct fetchPlanStructure {
+        uint32_t heads = 0;
+        fetchHeadStructure head[maxAttributes];
+        void const *indices = nullptr; ///< index buffer, nullptr when indexing is disabled
+        uint32_t (*fetchIndex)(void const *indices, uint32_t i) = nullptr; ///< specialized for the index type
+    };
+
+    // vertices are prefetched this many invocations ahead
+    static const uint32_t FETCH_DISTANCE = 8;
+
+    void compileFetchPlan(vertexPullerSettingStructure *puller, fetchPlanStructure &plan);
+
+    static void fetchVertex(fetchPlanStructure const &plan, uint32_t index, InVertex *inv);
+
+    static void prefetchVertex(fetchPlanStructure const &plan, uint32_t index);
 
     // *****************************************************************************
 
     struct programSettingStructure {
         VertexShader vs;
+        VertexShaderBatch vsBatch; // used instead of vs when attached
         FragmentShader fs;
+        FragmentShaderBatch fsBatch; // used instead of fs when attached
         AttributeType v2f[maxAttributes];      // 16x
         Uniforms *uni; // 16x
     };
@@ -204,11 +479,18 @@ public:
 
     // *****************************************************************************
 
+    // color and depth planes are tightly packed and 64 byte aligned,
+    // tiled planes store 8x8 micro-tiles one after another with pixels of a micro-tile in Morton order
     struct frameBufferStructure {
-        buffersStructure *colorB;
-        buffersStructure *depthB;
-        uint32_t width;
-        uint32_t height;
+        uint8_t *color = nullptr; ///< RGBA, ColorPixelS bytes per pixel
+        uint8_t *depth = nullptr; ///< depth in depth_format, DepthPixelS bytes per pixel
+        DepthFormat depth_format = DepthFormat::D32F;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        bool tiled = false;
+        uint32_t tiles_x = 0; ///< number of micro-tiles in one row
+        uint8_t *linear_color = nullptr; ///< linear color resolved from the tiled plane on readback
+        float *linear_depth = nullptr; ///< linear float depth resolved from tiled or non float plane on readback
     };
 
     frameBufferStructure *FB;
@@ -216,6 +498,31 @@ public:
     u_int32_t ColorPixelS = 4 * sizeof(uint8_t);
     u_int32_t DepthPixelS = 1 * sizeof(float);
 
+    static const size_t FRAMEBUFFER_ALIGNMENT = 64;
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    bool hugePages = false;
+    bool tiling = false;
+
+    void *allocatePlane(size_t size);
+
+    uint64_t pixelOffset(uint64_t x, uint64_t y);
+
+    void resolveLinearColor();
+
+    void resolveLinearDepth();
+
+    // depth test works with keys that grow with depth, stored depth is converted from and to keys
+    float depthKey(float z);
+
+    float loadDepthKey(uint64_t offset);
+
+    void storeDepthKey(uint64_t offset, float key);
+
+    void fillDepthKey(uint64_t begin, uint64_t end, float key);
+
+    float depthFromKey(float key);
+
     uint8_t convertColor(float value);
 
     // *****************************************************************************
@@ -224,15 +531,175 @@ public:
         OutVertex ov[3];
     };
 
-    void getAssembly(programSettingStructure *program, vertexPullerSettingStructure *puller, uint32_t triangle_num, Assembly & a);
+    // packed layout of enabled vertex to fragment attributes,
+    // packed component i is attributes[attribute[i]].v4[component[i]]
+    struct varyingLayoutStructure {
+        uint32_t count = 0;
+        uint8_t attribute[maxAttributes * 4];
+        uint8_t component[maxAttributes * 4];
+    };
+
+    void getVaryingLayout(programSettingStructure *program, varyingLayoutStructure &layout);
+
+    // every 2x2 quad is stored as its coverage mask followed by four lanes,
+    // lane is stored as gl_FragCoord followed by its packed attributes
+    struct fragmentQueueStructure {
+        std::vector<float> fragments;
+        programSettingStructure *program = nullptr;
+        varyingLayoutStructure const *layout = nullptr;
+        uint32_t stride = 0; ///< number of floats of one quad
+        uint64_t count = 0; ///< number of covered fragments
+        uint64_t capacity = 0;
+        std::vector<float> batch; ///< structure of arrays storage of the batched fragment shader
+    };
+
+    uint32_t triangleBatchSize = 256;
+    uint32_t fragmentBatchSize = 1024;
+
+    float *pushQuad(fragmentQueueStructure &queue, uint32_t covered);
+
+    void flushFragments(fragmentQueueStructure &queue);
+
+    void flushFragmentBatches(fragmentQueueStructure &queue);
+
+    // *****************************************************************************
+
+    struct depthStateStructure {
+        bool test = true;
+        DepthFunction func = DepthFunction::LESS;
+        bool write = true;
+        float clear = 1.1f; ///< depth written by clear, beyond the far plane by default
+    };
 
-    void getTypes(vertexPullerSettingStructure *puller, AttributeType *attribute_types);
+    depthStateStructure depthState;
+
+    bool passDepthTest(float depth, float buffer_depth);
+
+    struct hiZStructure {
+        uint32_t blocks_x = 0; ///< number of 8x8 blocks in one row
+        uint32_t large_x = 0; ///< number of 32x32 blocks in one row
+        std::vector<float> blocks; ///< maximal depth of 8x8 blocks
+        std::vector<float> large; ///< maximal depth of 32x32 blocks
+    };
+
+    hiZStructure hiZ;
+
+    // fast clear: clear only records its values, 8x8 blocks are filled on the first write or on readback
+    struct fastClearStructure {
+        std::vector<uint8_t> blocks; ///< 1 for 8x8 blocks that still hold the clear values
+        bool pending = false; ///< some block was not filled yet
+        uint32_t color = 0; ///< packed RGBA clear color
+        float depth = 1.1f; ///< key of the clear depth
+    };
+
+    fastClearStructure fastClear;
+
+    void resolveClearBlock(uint64_t x, uint64_t y);
+
+    void resolveFastClear();
+
+    void initHiZ(float depth);
+
+    void updateHiZ(uint64_t x, uint64_t y);
+
+    CullFace cullFace = CullFace::NONE;
+    FrontFace frontFace = FrontFace::CCW;
+
+    bool isCulled(Assembly &ass);
+
+    struct planeStructure {
+        float dx;
+        float dy;
+        float origin; ///< value in the first vertex of the triangle
+    };
+
+    struct triangleSetupStructure {
+        bool visible;
+        edgeSetupStructure edges;
+        int64_t left_down[2];
+        int64_t right_top[2];
+        float min_z; ///< lower bound of the interpolated depth, nearest vertex depth minus rounding margin
+        float origin[2]; ///< screen position of the first vertex, planes are evaluated relative to it
+        planeStructure inv_w; ///< 1 / w
+        planeStructure z; ///< z / w
+        planeStructure *varyings; ///< attribute / w, one plane per packed component
+    };
+
+    struct tileStructure {
+        uint32_t left_down[2];
+        uint32_t right_top[2];
+        std::vector<uint32_t> triangles;
+    };
+
+    uint32_t tileSize = 64;
+
+    ThreadPool *pool = nullptr;
+
+    std::vector<tileStructure> tiles;
+
+    void initTiles();
+
+    void binTriangles(std::vector<triangleSetupStructure> &triangles);
+
+    static const uint32_t VERTEX_CHUNK = 64;
+
+    void parallelChunks(uint32_t count, std::function<void(uint32_t begin, uint32_t end)> const &job);
+
+    void processVertices(programSettingStructure *program, fetchPlanStructure const &plan, uint32_t first,
+                         uint32_t count, Assembly *assemblies);
+
+    // post-transform vertex cache, indexed vertices are shaded at most once per draw call
+    // slots cover only the index range of the current draw, slot 0 belongs to the index base
+    struct vertexCacheStructure {
+        std::vector<OutVertex> vertices;
+        std::vector<uint32_t> tags;
+        uint32_t draw = 0;
+        uint32_t base = 0;
+        std::vector<uint32_t> indices;
+        std::vector<uint32_t> misses;
+        uint64_t hits = 0;
+        uint64_t lookups = 0;
+    };
+
+    vertexCacheStructure vertexCache;
+
+    // index range that is always cached, larger ranges only when the draw has at least as many indices
+    static const uint32_t VERTEX_CACHE_RANGE = 1 << 16;
+
+    bool beginVertexCache(fetchPlanStructure const &plan, uint32_t count);
+
+    void shadeVertexBatch(programSettingStructure *program, fetchPlanStructure const &plan,
+                          uint32_t const *indices, uint32_t count, OutVertex *const *outputs);
+
+    void processIndexedVertices(programSettingStructure *program, fetchPlanStructure const &plan,
+                                uint32_t first, uint32_t count, Assembly *assemblies);
 
     void getV2FTypes(buffersStructure *buffer, AttributeType *v2f_types);
 
-    std::vector<Assembly> clipAssembly(Assembly as, AttributeType types[maxAttributes]);
+    enum ClipCode : uint32_t {
+        CLIP_LEFT = 1,
+        CLIP_RIGHT = 2,
+        CLIP_BOTTOM = 4,
+        CLIP_TOP = 8,
+        CLIP_NEAR = 16,
+        CLIP_FAR = 32,
+        CLIP_FRUSTUM = 63,
+        CLIP_GUARD_LEFT = 64,
+        CLIP_GUARD_RIGHT = 128,
+        CLIP_GUARD_BOTTOM = 256,
+        CLIP_GUARD_TOP = 512,
+        CLIP_GUARD = CLIP_NEAR | 960, ///< planes that are really clipped
+    };
+
+    uint32_t getClipCode(glm::vec4 const &position, glm::vec2 view_extent, glm::vec2 guard_band);
+
+    static const uint32_t MAX_CLIP_VERTICES = 9; ///< 3 vertices + one vertex per clip plane
+
+    void clipAssembly(Assembly const &as, varyingLayoutStructure const &layout, glm::vec2 guard_band,
+                      std::vector<Assembly> &out);
 
-    OutVertex countOutVer(OutVertex A_OV, OutVertex B_OV, AttributeType types[maxAttributes]);
+    void countOutVer(OutVertex const &A_OV, OutVertex const &B_OV, varyingLayoutStructure const &layout, float t,
+                     OutVertex &O_OV);
 
     float countLinCombination(float A, float B, float t);
 
@@ -248,32 +715,48 @@ public:
 
     void viewPortTransformation(Assembly &ass, float width, float height);
 
-    std::vector<InFragment> rasterize(Assembly ass, AttributeType *v2s_types);
+    bool setupTriangle(Assembly &ass, varyingLayoutStructure const &layout, triangleSetupStructure &setup);
+
+    // VARYINGS is the number of packed varying components, -1 reads it from the layout
+    template<int32_t VARYINGS>
+    void rasterize(triangleSetupStructure const &triangle, varyingLayoutStructure const &layout,
+                   tileStructure const &area, fragmentQueueStructure &queue);
+
+    using RasterKernel = void (GPU::*)(triangleSetupStructure const &triangle, varyingLayoutStructure const &layout,
+                                       tileStructure const &area, fragmentQueueStructure &queue);
+
+    static const int32_t MAX_SPECIALIZED_VARYINGS = 8;
+
+    varyingLayoutStructure varyingLayout;
+    RasterKernel rasterKernel = &GPU::rasterize<-1>;
+
+    void selectRasterKernel();
 
-    void getConvexCover(glm::vec4 A, glm::vec4 B, glm::vec4 C, uint64_t left_down[], uint64_t right_top[]);
+    static const uint32_t LARGE_BLOCK = 32;
 
-    void getDeltas(glm::vec4 A, glm::vec4 B, glm::vec4 C, std::vector<glm::vec2> &deltas);
+    static const uint32_t SMALL_TRIANGLE = 4;
 
-    void edgeFunction(glm::vec4 A, glm::vec4 B, glm::vec4 C, std::vector<glm::vec2> &deltas, float x, float y,
-                      glm::vec3 &edges);
+    uint32_t coverageKernelWidth = 1;
+    CoverageKernel coverageKernel = nullptr;
 
-    void edgesRight(glm::vec3 &edges, std::vector<glm::vec2> &deltas);
+    GatherKernel gatherKernel = nullptr;
 
-    void edgesUp(glm::vec3 &edges, std::vector<glm::vec2> &deltas);
+    static const uint32_t MAX_SUBPIXEL_BITS = 16;
 
-    void getBarycentricCoordinates(glm::vec4 A, glm::vec4 B, glm::vec4 C, glm::vec2 Point, glm::vec3 &Coordinates);
+    uint32_t subpixelBits = 8;
 
-    float countCoordinates(glm::vec4 A, glm::vec4 B, glm::vec4 C, glm::vec2 Point);
+    bool setupEdges(glm::vec4 A, glm::vec4 B, glm::vec4 C, edgeSetupStructure &setup, int64_t left_down[],
+                    int64_t right_top[]);
 
-    float perspectiveCorrection(glm::vec3 Coordinates, glm::vec3 h, float a1, float a2, float a3);
+    uint64_t getAreaMask(uint64_t x, uint64_t y, uint64_t left_down[], uint64_t right_top[]);
 
-    glm::vec2 perspectiveCorrection(glm::vec3 Coordinates, glm::vec3 h, glm::vec2 a1, glm::vec2 a2, glm::vec2 a3);
+    void getEdges(int64_t edges[], edgeSetupStructure const &setup, uint64_t x, uint64_t y);
 
-    glm::vec3 perspectiveCorrection(glm::vec3 Coordinates, glm::vec3 h, glm::vec3 a1, glm::vec3 a2, glm::vec3 a3);
+    void edgesRight(int64_t edges[], edgeSetupStructure const &setup, uint64_t pixels);
 
-    glm::vec4 perspectiveCorrection(glm::vec3 Coordinates, glm::vec3 h, glm::vec4 a1, glm::vec4 a2, glm::vec4 a3);
+    void edgesUp(int64_t edges[], edgeSetupStructure const &setup, uint64_t pixels);
 
-    void putPixel(uint32_t x, uint32_t y, glm::vec4 color, float depth);
+    void writeQuad(uint64_t x, uint64_t y, uint32_t lanes, uint32_t const pixels[4]);
 
     /// @}
 };
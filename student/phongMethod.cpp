@@ -7,6 +7,7 @@
 
 #include <student/phongMethod.hpp>
 #include <student/bunny.hpp>
+#include <cstddef>
 
 /** \addtogroup shader_side 06. Implementace vertex/fragment shaderu phongovy metody
  * Vašim úkolem ve vertex a fragment shaderu je transformovat trojúhelníky pomocí view a projekční matice a spočítat phongův osvětlovací model.
@@ -58,8 +59,40 @@ void phong_VS(OutVertex&outVertex,InVertex const&inVertex,Uniforms const&uniform
   /// struktuře.
   /// \image html images/vertex_shader_tasks.svg "Vizualizace vstupů a výstupů vertex shaderu" width=1000
 
+  auto const& view     = uniforms.uniform[0].m4;
+  auto const& proj     = uniforms.uniform[1].m4;
+  auto const& position = inVertex.attributes[0].v3;
+  auto const& normal   = inVertex.attributes[1].v3;
 
+  outVertex.gl_Position = proj*view*glm::vec4(position,1.f);
 
+  outVertex.attributes[0].v3 = position;
+  outVertex.attributes[1].v3 = normal;
+}
+
+/**
+ * @brief This function represents vertex shader of phong method, batched version of phong_VS.
+ * It transforms the whole batch with one view-projection matrix.
+ *
+ * @param outVertices output vertices
+ * @param inVertices input vertices
+ * @param uniforms uniform variables
+ */
+void phong_VSBatch(OutVertexBatch&outVertices,InVertexBatch const&inVertices,Uniforms const&uniforms){
+  auto const vp = uniforms.uniform[1].m4*uniforms.uniform[0].m4;
+
+  for(uint32_t i=0;i<inVertices.count;++i){
+    auto const x = inVertices.attributes[0][0][i];
+    auto const y = inVertices.attributes[0][1][i];
+    auto const z = inVertices.attributes[0][2][i];
+
+    for(int r=0;r<4;++r)
+      outVertices.gl_Position[r][i] = vp[0][r]*x + vp[1][r]*y + vp[2][r]*z + vp[3][r];
+
+    for(int a=0;a<2;++a)
+      for(int c=0;c<3;++c)
+        outVertices.attributes[a][c][i] = inVertices.attributes[a][c][i];
+  }
 }
 
 /**
@@ -121,7 +154,29 @@ void phong_FS(OutFragment&outFragment,InFragment const&inFragment,Uniforms const
   ///
   /// \image html images/fragment_shader_tasks.svg "Vizualizace výpočtu ve fragment shaderu" width=1000
 
+  auto const& position = inFragment.attributes[0].v3;
+  auto const& light    = uniforms.uniform[2].v3;
+  auto const& camera   = uniforms.uniform[3].v3;
+
+  auto const N = glm::normalize(inFragment.attributes[1].v3);
+  auto const L = glm::normalize(light-position);
+  auto const V = glm::normalize(camera-position);
 
+  // ten waved stripes in the xy plane, the texture repeats with period 1
+  auto const u       = position.x + glm::sin(position.y*10.f)/10.f;
+  auto const stripe  = static_cast<int>(glm::floor((u-glm::floor(u))*10.f));
+  auto const stripes = stripe%2 == 0 ? glm::vec3(0.f,.5f,0.f) : glm::vec3(1.f,1.f,0.f);
+
+  // snow covers surfaces that face upwards
+  auto const t       = N.y > 0.f ? N.y*N.y : 0.f;
+  auto const diffuse = glm::mix(stripes,glm::vec3(1.f),t);
+
+  auto const NdotL    = glm::dot(N,L);
+  auto const lambert  = glm::max(NdotL,0.f);
+  auto const R        = glm::reflect(-L,N);
+  auto const specular = NdotL > 0.f ? glm::pow(glm::max(glm::dot(R,V),0.f),40.f) : 0.f;
+
+  outFragment.gl_FragColor = glm::vec4(diffuse*lambert + glm::vec3(specular),1.f);
 }
 
 /// @}
@@ -159,6 +214,24 @@ PhongMethod::PhongMethod(){
 ///  - gpu.attachShaders()
 ///  - gpu.setVS2FSType()
 
+  B_vrcholy = gpu.createBuffer(sizeof(bunnyVertices));
+  gpu.setBufferData(B_vrcholy,0,sizeof(bunnyVertices),bunnyVertices);
+
+  B_indexy = gpu.createBuffer(sizeof(bunnyIndices));
+  gpu.setBufferData(B_indexy,0,sizeof(bunnyIndices),bunnyIndices);
+
+  VP_vp = gpu.createVertexPuller();
+  gpu.setVertexPullerIndexing(VP_vp,IndexType::UINT32,B_indexy);
+  gpu.setVertexPullerHead(VP_vp,0,AttributeType::VEC3,sizeof(BunnyVertex),offsetof(BunnyVertex,position),B_vrcholy);
+  gpu.enableVertexPullerHead(VP_vp,0);
+  gpu.setVertexPullerHead(VP_vp,1,AttributeType::VEC3,sizeof(BunnyVertex),offsetof(BunnyVertex,normal),B_vrcholy);
+  gpu.enableVertexPullerHead(VP_vp,1);
+
+  // batched vertex shader lets the gpu gather the interleaved bunny vertices into SoA lanes
+  prg = gpu.createProgram();
+  gpu.attachShaders(prg,phong_VSBatch,phong_FS);
+  gpu.setVS2FSType(prg,0,AttributeType::VEC3);
+  gpu.setVS2FSType(prg,1,AttributeType::VEC3);
 }
 
 
@@ -186,6 +259,18 @@ void PhongMethod::onDraw(glm::mat4 const&proj,glm::mat4 const&view,glm::vec3 con
 ///  - gpu.unbindVertexPuller()
 
   gpu.clear(.5f,.5f,.5f,1.f);
+
+  gpu.bindVertexPuller(VP_vp);
+  gpu.useProgram(prg);
+
+  gpu.programUniformMatrix4f(prg,0,view);
+  gpu.programUniformMatrix4f(prg,1,proj);
+  gpu.programUniform3f      (prg,2,light);
+  gpu.programUniform3f      (prg,3,camera);
+
+  gpu.drawTriangles(sizeof(bunnyIndices)/sizeof(VertexIndex));
+
+  gpu.unbindVertexPuller();
 }
 
 /**
@@ -198,6 +283,10 @@ PhongMethod::~PhongMethod(){
   ///  - gpu.deleteVertexPuller()
   ///  - gpu.deleteBuffer()
 
+  gpu.deleteProgram(prg);
+  gpu.deleteVertexPuller(VP_vp);
+  gpu.deleteBuffer(B_indexy);
+  gpu.deleteBuffer(B_vrcholy);
 }
 
 /// @}
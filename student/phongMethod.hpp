@@ -26,6 +26,7 @@ private:
     BufferID B_vrcholy;
     BufferID B_indexy;
     ObjectID VP_vp;
+    ProgramID prg;///< id of program
     /// \todo Zde si vytvořte proměnné, které budete potřebovat (id bufferů, programu, ...)
 
 };